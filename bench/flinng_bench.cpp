@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lib_flinng.h"
+
+using namespace std;
+
+// Reproducible micro benchmarks of every stage of FLINNG on synthetic data.
+// Each configuration varies one parameter of a base configuration. For every
+// stage, throughput is measured on a full batch and latency percentiles on
+// repeated small calls; results are written as JSON.
+
+struct Config {
+  uint64_t data_dimension, dataset_size, num_rows, cells_per_row, num_hash_tables, hashes_per_table;
+};
+
+struct Result {
+  string name;
+  Config config;
+  string unit; /// what throughput counts per second
+  double throughput;
+  vector<double> latencies_us;
+};
+
+template<typename F>
+static double time_us(F fn) {
+  auto start = chrono::steady_clock::now();
+  fn();
+  return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+static double percentile(vector<double> samples, double p) {
+  if (samples.empty()) {
+    return 0;
+  }
+  sort(samples.begin(), samples.end());
+  return samples[min<uint64_t>(samples.size() - 1, p * samples.size())];
+}
+
+static void write_json(ostream &out, const vector<Result> &results) {
+  out << "{\n  \"benchmarks\": [\n";
+  for (uint64_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    const Config &c = r.config;
+    out << "    {\"name\": \"" << r.name << "\", "
+        << "\"config\": {\"data_dimension\": " << c.data_dimension << ", \"dataset_size\": " << c.dataset_size
+        << ", \"num_rows\": " << c.num_rows << ", \"cells_per_row\": " << c.cells_per_row
+        << ", \"num_hash_tables\": " << c.num_hash_tables << ", \"hashes_per_table\": " << c.hashes_per_table
+        << "}, \"throughput\": " << r.throughput << ", \"throughput_unit\": \"" << r.unit << "/s\", "
+        << "\"latency_us\": {\"samples\": " << r.latencies_us.size()
+        << ", \"p50\": " << percentile(r.latencies_us, 0.5) << ", \"p90\": " << percentile(r.latencies_us, 0.9)
+        << ", \"p99\": " << percentile(r.latencies_us, 0.99) << ", \"max\": " << percentile(r.latencies_us, 1)
+        << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+static void run_config(const Config &c, uint64_t latency_samples, const string &tmp_index, vector<Result> &results) {
+  srand(42);
+  default_random_engine generator(42);
+  normal_distribution<float> data_dist(0.0f, 1.0f), noise_dist(0.0f, 0.1f);
+  uniform_int_distribution<uint64_t> point_dist(0, c.dataset_size - 1), element_dist(0, 1000000);
+
+  vector<float> dataset(c.dataset_size * c.data_dimension);
+  for (float &value: dataset) {
+    value = data_dist(generator);
+  }
+  uint64_t num_queries = min<uint64_t>(1000, c.dataset_size);
+  vector<float> queries(num_queries * c.data_dimension);
+  for (uint64_t q = 0; q < num_queries; q++) {
+    uint64_t point = point_dist(generator);
+    for (uint64_t j = 0; j < c.data_dimension; j++) {
+      queries[q * c.data_dimension + j] = dataset[point * c.data_dimension + j] + noise_dist(generator);
+    }
+  }
+  const uint64_t sparse_length = 64;
+  vector<uint64_t> sparse(c.dataset_size * sparse_length);
+  for (uint64_t &element: sparse) {
+    element = element_dist(generator);
+  }
+  vector<int8_t> rand_bits(c.num_hash_tables * c.hashes_per_table * c.data_dimension);
+  for (int8_t &bit: rand_bits) {
+    bit = (rand() % 2) * 2 - 1;
+  }
+
+  auto add = [&](const string &name, const string &unit, double items, double total_us, vector<double> latencies) {
+    results.push_back({name, c, unit, items / (total_us / 1e6), latencies});
+    cerr << "  " << name << ": " << results.back().throughput << " " << unit << "/s, p50 "
+         << percentile(latencies, 0.5) << " us" << endl;
+  };
+
+  // Hashing
+  vector<uint64_t> hashes;
+  {
+    double total = time_us([&]() {
+      hashes = parallel_srp(dataset.data(), c.dataset_size, c.data_dimension, rand_bits.data(),
+                            c.num_hash_tables, c.hashes_per_table);
+    });
+    vector<double> latencies;
+    for (uint64_t i = 0; i < latency_samples; i++) {
+      latencies.push_back(time_us([&]() {
+        parallel_srp(queries.data() + (i % num_queries) * c.data_dimension, 1, c.data_dimension,
+                     rand_bits.data(), c.num_hash_tables, c.hashes_per_table);
+      }));
+    }
+    add("parallel_srp", "points", c.dataset_size, total, latencies);
+  }
+  {
+    // sub_hash_bits = 2, so at most 2 bits per sub hash out of hashes_per_table
+    uint64_t l2_hashes_per_table = c.hashes_per_table / 2;
+    double total = time_us([&]() {
+      parallel_l2_lsh(dataset.data(), c.dataset_size, c.data_dimension, rand_bits.data(),
+                      c.num_hash_tables, l2_hashes_per_table);
+    });
+    vector<double> latencies;
+    for (uint64_t i = 0; i < latency_samples; i++) {
+      latencies.push_back(time_us([&]() {
+        parallel_l2_lsh(queries.data() + (i % num_queries) * c.data_dimension, 1, c.data_dimension,
+                        rand_bits.data(), c.num_hash_tables, l2_hashes_per_table);
+      }));
+    }
+    add("parallel_l2_lsh", "points", c.dataset_size, total, latencies);
+  }
+  {
+    double total = time_us([&]() {
+      parallel_densified_minhash(sparse.data(), c.dataset_size, sparse_length, c.num_hash_tables,
+                                 c.hashes_per_table, c.hashes_per_table, 42);
+    });
+    vector<double> latencies;
+    for (uint64_t i = 0; i < latency_samples; i++) {
+      latencies.push_back(time_us([&]() {
+        parallel_densified_minhash(sparse.data() + (i % c.dataset_size) * sparse_length, 1, sparse_length,
+                                   c.num_hash_tables, c.hashes_per_table, c.hashes_per_table, 42);
+      }));
+    }
+    add("parallel_densified_minhash", "points", c.dataset_size, total, latencies);
+  }
+
+  // Build, in batches so that every batch is a latency sample. addPoints
+  // ends with prepareForQueries, so these timings include sorting every
+  // posting list after each batch; calling it again would only re-sort
+  // sorted lists.
+  Flinng flinng(c.num_rows, c.cells_per_row, c.num_hash_tables, 1 << c.hashes_per_table);
+  {
+    const uint64_t batch_size = max<uint64_t>(1, c.dataset_size / 20);
+    vector<double> latencies;
+    double total = 0;
+    for (uint64_t begin = 0; begin < c.dataset_size; begin += batch_size) {
+      uint64_t end = min(c.dataset_size, begin + batch_size);
+      vector<uint64_t> batch(hashes.begin() + begin * c.num_hash_tables, hashes.begin() + end * c.num_hash_tables);
+      latencies.push_back(time_us([&]() { flinng.addPoints(batch); }));
+      total += latencies.back();
+    }
+    add("Flinng::addPoints", "points", c.dataset_size, total, latencies);
+  }
+
+  // Query
+  {
+    vector<uint64_t> query_hashes = parallel_srp(queries.data(), num_queries, c.data_dimension, rand_bits.data(),
+                                                 c.num_hash_tables, c.hashes_per_table);
+    double total = time_us([&]() { flinng.query(query_hashes, 10); });
+    vector<double> latencies;
+    for (uint64_t i = 0; i < latency_samples; i++) {
+      vector<uint64_t> one(query_hashes.begin() + (i % num_queries) * c.num_hash_tables,
+                           query_hashes.begin() + (i % num_queries + 1) * c.num_hash_tables);
+      latencies.push_back(time_us([&]() { flinng.query(one, 10); }));
+    }
+    add("Flinng::query", "queries", num_queries, total, latencies);
+  }
+
+  // Index I/O
+  {
+    flinng::FlinngBuilder spec(c.num_rows, c.cells_per_row, c.num_hash_tables, c.hashes_per_table);
+    {
+      flinng::DenseFlinng32 index(c.data_dimension, &spec);
+      index.add_and_store(dataset.data(), c.dataset_size);
+      index.finalize_construction();
+      vector<double> latencies;
+      for (uint64_t i = 0; i < 3; i++) {
+        latencies.push_back(time_us([&]() { index.write_index(tmp_index.c_str()); }));
+      }
+      ifstream written(tmp_index, ios::binary | ios::ate);
+      double bytes = written.tellg();
+      add("write_index", "bytes", bytes * latencies.size(), latencies[0] + latencies[1] + latencies[2], latencies);
+
+      latencies.clear();
+      for (uint64_t i = 0; i < 3; i++) {
+        latencies.push_back(time_us([&]() {
+          delete flinng::BaseDenseFlinng32::from_index(tmp_index.c_str());
+        }));
+      }
+      add("from_index", "bytes", bytes * latencies.size(), latencies[0] + latencies[1] + latencies[2], latencies);
+    }
+    remove(tmp_index.c_str());
+  }
+}
+
+static void usage() {
+  cerr << "Usage: flinng_bench [--out <results.json>] [--quick] [--latency-samples <n>] [--tmp <index file>]\n"
+       << "Runs every stage of FLINNG on synthetic data over a sweep of dimensions, dataset sizes,\n"
+       << "num_rows, cells_per_row and table counts, and writes the results as JSON (stdout by default)." << endl;
+}
+
+int main(int argc, char **argv) {
+  string out_file, tmp_index = "flinng_bench_index";
+  bool quick = false;
+  uint64_t latency_samples = 200;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--quick") {
+      quick = true;
+    } else if (arg == "--out" && i + 1 < argc) {
+      out_file = argv[++i];
+    } else if (arg == "--tmp" && i + 1 < argc) {
+      tmp_index = argv[++i];
+    } else if (arg == "--latency-samples" && i + 1 < argc) {
+      latency_samples = stoull(argv[++i]);
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  const Config base = {64, quick ? 5000u : 50000u, 3, quick ? 50u : 500u, 32, 12};
+  vector<Config> configs = {base};
+  for (uint64_t dim: {16, 128}) {
+    Config c = base;
+    c.data_dimension = dim;
+    configs.push_back(c);
+  }
+  for (uint64_t size: {base.dataset_size / 5, base.dataset_size * 4}) {
+    Config c = base;
+    c.dataset_size = size;
+    c.cells_per_row = max<uint64_t>(1, size / 100);
+    configs.push_back(c);
+  }
+  for (uint64_t rows: {2, 4}) {
+    Config c = base;
+    c.num_rows = rows;
+    configs.push_back(c);
+  }
+  for (uint64_t cells: {base.cells_per_row / 4, base.cells_per_row * 4}) {
+    Config c = base;
+    c.cells_per_row = cells;
+    configs.push_back(c);
+  }
+  for (uint64_t tables: {base.num_hash_tables / 2, base.num_hash_tables * 4}) {
+    Config c = base;
+    c.num_hash_tables = tables;
+    configs.push_back(c);
+  }
+
+  vector<Result> results;
+  for (const Config &c: configs) {
+    cerr << "dim=" << c.data_dimension << " size=" << c.dataset_size << " rows=" << c.num_rows
+         << " cells_per_row=" << c.cells_per_row << " tables=" << c.num_hash_tables
+         << " hashes_per_table=" << c.hashes_per_table << endl;
+    run_config(c, latency_samples, tmp_index, results);
+  }
+
+  if (out_file.empty()) {
+    write_json(cout, results);
+  } else {
+    ofstream out(out_file);
+    write_json(out, results);
+  }
+  return 0;
+}
@@ -5,14 +5,100 @@
 #include <cstdint>
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include <stdexcept>
+#include <unordered_map>
 #include <vector>
+#include "MemoryReport.h"
+#include "QueryStats.h"
+#include "ThreadPool.h"
 #include "io.h"
 
+namespace flinng {
+  class StreamingIndexBuilder;
+
+  // Restricts a query to the points whose label is accepted, see
+  // Flinng::set_labels. The allow-list bitmap is checked inline, a predicate
+  // costs an indirect call per resolved candidate.
+  struct LabelFilter {
+    std::vector<uint64_t> allowed;           /// bit l is set if label l is allowed
+    std::function<bool(uint32_t)> predicate; /// used when allowed is empty
+
+    static LabelFilter allow(const std::vector<uint32_t> &labels);
+
+    static LabelFilter matching(std::function<bool(uint32_t)> predicate);
+
+    bool accepts(uint32_t label) const {
+      if (!allowed.empty()) {
+        return label / 64 < allowed.size() && (allowed[label / 64] >> (label % 64) & 1);
+      }
+      return !predicate || predicate(label);
+    }
+  };
+
+  // How queries treat oversized posting lists, those longer than
+  // max(min_length, oversize_factor * the mean length of non-empty lists).
+  // Clustered data piles many points into a few buckets, which every query
+  // hashing into them has to scan in full.
+  enum class BucketPolicy : uint32_t {
+    none,
+    cap,         /// scans at most cap_length evenly strided entries
+    down_weight, /// counts 1 / down_weight as much as other lists
+    split        /// looks up one of 2^split_bits lists, see Flinng::split_oversized_buckets
+  };
+
+  struct BucketBalance {
+    BucketPolicy policy = BucketPolicy::none;
+    double oversize_factor = 8;
+    uint64_t min_length = 64;
+    uint64_t cap_length = 0; /// 0 caps at the oversize threshold
+    uint32_t down_weight = 2;
+    uint32_t split_bits = 2;
+  };
+
+  // Posting list lengths, gathered by prepareForQueries
+  struct BucketStats {
+    uint64_t num_lists = 0, num_empty = 0, total_entries = 0, max_length = 0;
+    uint64_t threshold = 0; /// lists longer than this are oversized
+    uint64_t num_oversized = 0, oversized_entries = 0;
+  };
+
+  // Per query tradeoffs between latency and recall
+  struct QueryOptions {
+    // Probes only the first num_tables hash tables, 0 probes all of them
+    uint64_t num_tables = 0;
+
+    // If positive, stops counting once the leading_cells highest cells lead
+    // every other cell by more than the remaining tables could plausibly
+    // change, i.e. by early_stop_z * sqrt(remaining tables), capped at the
+    // number of remaining tables. Checked every check_interval tables.
+    double early_stop_z = 0;
+    uint64_t check_interval = 8;
+
+    // 0 uses num_rows * top_k, the fewest cells that can hold top_k results
+    uint64_t leading_cells = 0;
+
+    // Buckets looked up per table: the hashed bucket and the num_probes - 1
+    // most likely neighboring buckets (see single_srp). Cells count
+    // primary_weight for the hashed bucket and 1 for every probed one, so
+    // once the probes outweigh the hashed bucket they drown it out and recall
+    // drops; raise primary_weight along with num_probes beyond a few.
+    // Only dense indexes derive probes.
+    uint64_t num_probes = 1;
+    uint32_t primary_weight = 2;
+
+    // If not null, only points whose label filter accepts count towards
+    // top_k. Cells are walked further down until top_k matches are found.
+    const LabelFilter *filter = nullptr;
+  };
+}
+
 // TODO: Add back 16 bit FLINNG, check input
 // TODO: Reproduce experiments
 // TODO: Add percent of srp used
 class Flinng {
+  friend class flinng::StreamingIndexBuilder;
 
 public:
   Flinng(uint64_t num_rows, uint64_t cells_per_row, uint64_t num_hashes,
@@ -29,17 +115,165 @@ public:
   // Results are similarly ordered
   std::vector<uint64_t> query(const std::vector<uint64_t> &hashes, uint32_t top_k);
 
+  // Same as above, but also fills scores with the cell-hit count at which each
+  // result was identified (higher is better), ordered like the results
+  std::vector<uint64_t> query(const std::vector<uint64_t> &hashes, uint32_t top_k,
+                              std::vector<uint32_t> &scores);
+
+  // Same as the first query, and fills stats, which is null or holds one entry
+  // per query. The hash_ns of every entry is kept as set by the caller. With
+  // multi-probe options, hashes holds num_probes values per table.
+  std::vector<uint64_t> query(const std::vector<uint64_t> &hashes, uint32_t top_k,
+                              flinng::QueryStats *stats, const flinng::QueryOptions *options = nullptr);
+
+  // Ranks a single query given its hashes, writing top_k ids to results and,
+  // if scores is not null, their scores. If stats is not null it is filled as
+  // above. Slots left without a result, when fewer than top_k points exist
+  // or match the filter of options, are set to UINT64_MAX. hashes must hold
+  // num_probes values for every table that options probe, one for each of the
+  // num_hash_tables without options.
+  void query_one(const uint64_t *hashes, uint32_t top_k, uint64_t *results,
+                 uint32_t *scores = nullptr, flinng::QueryStats *stats = nullptr,
+                 const flinng::QueryOptions *options = nullptr) const;
+
+  // Writes the hashes, num_probes per table, of tables
+  // [first_table, first_table + num_tables) to hashes
+  typedef std::function<void(uint64_t first_table, uint64_t num_tables, uint64_t *hashes)> TableHasher;
+
+  // Same as query_one, but asks hasher for the hashes of each block of tables
+  // just before counting it, so tables skipped by early termination are never
+  // hashed. Sets the hash_ns of stats.
+  void query_one_lazy(const TableHasher &hasher, uint32_t top_k, uint64_t *results,
+                      uint32_t *scores = nullptr, flinng::QueryStats *stats = nullptr,
+                      const flinng::QueryOptions *options = nullptr) const;
+
+  // Number of tables options probe
+  uint64_t tables_to_probe(const flinng::QueryOptions *options) const;
+
+  static uint64_t probes_per_table(const flinng::QueryOptions *options);
+
+  // Aggregate statistics of every query so far, null unless built with
+  // FLINNG_ENABLE_STATS. Copies of a Flinng share their aggregate.
+  const flinng::IndexStats *query_stats() const;
+
+  void reset_query_stats();
+
+  // The count posting lists in which queries scanned the most entries. Without
+  // statistics every read count is 0 and the longest posting lists come first.
+  std::vector<flinng::HotBucket> hot_buckets(uint64_t count) const;
+
   uint64_t num_points_added() const;
 
+  // Sets the labels of points [first_point, first_point + num_points), which
+  // must have been added. Points that were never labeled have label 0.
+  void set_labels(uint64_t first_point, const uint32_t *point_labels, uint64_t num_points);
+
+  uint32_t label(uint64_t point) const;
+
+  bool has_labels() const;
+
+  // Sets the policy for oversized posting lists, which every query then
+  // applies. Changing the policy drops split lists.
+  void set_bucket_balance(const flinng::BucketBalance &balance);
+
+  const flinng::BucketBalance &bucket_balance() const;
+
+  const flinng::BucketStats &bucket_stats() const;
+
+  // Writes the hashes of every table for points [first_point,
+  // first_point + num_points), each made with split_hash
+  typedef std::function<void(uint64_t first_point, uint64_t num_points, uint64_t *hashes)> PointHasher;
+
+  // Splits every oversized posting list into 2^split_bits lists, one for each
+  // value of extra hash bits that hasher derives for every point added so
+  // far. Queries then scan the split list their hash selects, or the whole
+  // list for hashes made without split_hash. Requires the split policy.
+  // addPoints and merge drop split lists since they would miss new points.
+  void split_oversized_buckets(const PointHasher &hasher);
+
+  bool is_split(uint64_t table, uint64_t hash) const;
+
+  bool has_split_buckets() const;
+
+  // Encodes the extra bits of a split bucket into a hash of it
+  uint64_t split_hash(uint64_t hash, uint64_t extra) const {
+    return hash + hash_range * (extra + 1);
+  }
+
+  // Keeps the hashes of every point added from now on, num_hash_tables values
+  // per point, so that regroup can rebuild the cells without rehashing.
+  // Stopping discards them.
+  void store_signatures(bool store);
+
+  bool stores_signatures() const;
+
+  // Reassigns every point to num_rows new random cells in each of
+  // cells_per_row rows, rebuilding the posting lists and cells in parallel
+  // from the stored signatures. Labels and the bucket policy are kept, split
+  // lists are dropped.
+  void regroup(uint64_t num_rows, uint64_t cells_per_row);
+
+  // Appends all points of other, which must have the same num_rows,
+  // cells_per_row, num_hash_tables and hash_range and have been built with the
+  // same hash functions. Point i of other becomes point num_points_added() + i.
+  // Either both or neither must store signatures, and other cannot be this index.
+  void merge(const Flinng &other);
+
+  // Bytes held by the posting lists, cell membership, labels, signatures and
+  // query statistics
+  flinng::MemoryReport memory_report() const;
+
+  // Reallocates every posting list and cell to its size, releasing the spare
+  // capacity left by addPoints. Each thread copies one list at a time, so the
+  // peak memory exceeds the current footprint by at most one list per thread.
+  void compact();
+
+  // Runs addPoints and query on pool instead of OpenMP, null goes back to OpenMP
+  void set_thread_pool(std::shared_ptr<flinng::ThreadPool> pool);
+
   void write_content_to_index(flinng::FileIO &index);
 
   void read_content_from_index(flinng::FileIO &index);
 
+  // Optional sections following the fixed content, see write_section_header
+  void write_sections_to_index(flinng::FileIO &index);
+
+  // Reads the section if its tag belongs to Flinng, returns false otherwise
+  bool read_section_from_index(flinng::FileIO &index, uint32_t tag, uint64_t size);
+
 private:
   uint64_t num_rows, cells_per_row, num_hash_tables, hash_range;
   uint64_t total_points_added = 0;
   std::vector<std::vector<uint32_t>> inverted_flinng_index;
   std::vector<std::vector<uint64_t>> cell_membership;
+  std::vector<uint32_t> labels; /// empty until set_labels, then one per point
+  flinng::BucketBalance balance;
+  flinng::BucketStats buckets;
+  std::unordered_map<uint64_t, std::vector<std::vector<uint32_t>>> split_lists; /// by posting list index
+  bool keep_signatures = false;
+  std::vector<uint32_t> signatures; /// num_hash_tables hashes per point, if kept
+  std::shared_ptr<flinng::ThreadPool> thread_pool;
+  std::shared_ptr<flinng::IndexStats> index_stats;
+
+  void rank(const uint64_t *hashes, const TableHasher *hasher, uint32_t top_k, uint64_t *results,
+            uint32_t *scores, flinng::QueryStats *stats, const flinng::QueryOptions *options) const;
+
+  void update_bucket_stats();
+
+  // Adjusts the list, weight and stride with which an oversized list is scanned
+  void apply_bucket_policy(uint64_t index, uint64_t hash, const std::vector<uint32_t> *&list, uint32_t &weight,
+                           uint32_t &stride) const;
+
+  bool leading_cells_separated(const std::vector<uint32_t> &counts, uint64_t max_count, uint64_t tables_left,
+                               uint32_t table_weight, uint64_t leading_cells, double z) const;
+
+  void resolve_candidates(const std::vector<uint32_t> *sorted, uint32_t max_count, uint32_t top_k,
+                          uint64_t *results, uint32_t *scores, flinng::QueryStats *stats,
+                          const flinng::LabelFilter *filter) const;
+
+  bool accepts(const flinng::LabelFilter *filter, uint64_t point) const {
+    return filter == nullptr || filter->accepts(labels.empty() ? 0 : labels[point]);
+  }
 };
 
 #endif
\ No newline at end of file
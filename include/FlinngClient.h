@@ -0,0 +1,74 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "FlinngProtocol.h"
+
+namespace flinng {
+
+  // Client for flinng_server. The blocking calls send one request and wait for
+  // its response; send_* and receive allow pipelining many requests. A client
+  // must only be used by one thread at a time.
+  class FlinngClient {
+
+  public:
+    struct Response {
+      uint8_t status = protocol::ERROR;
+      uint8_t opcode = 0;
+      uint32_t request_id = 0;
+      std::string error;
+      uint64_t dimension = 0, num_points = 0;
+      bool stores_dataset = false;
+      uint32_t num_queries = 0, top_k = 0;
+      std::vector<int64_t> ids;
+      std::vector<float> distances;
+    };
+
+    explicit FlinngClient(const char *socket_path);
+
+    ~FlinngClient();
+
+    bool connected() const;
+
+    bool info(uint32_t index_id, uint64_t &dimension, uint64_t &num_points);
+
+    // Returns the number of points in the index after the add, 0 on error
+    uint64_t add(uint32_t index_id, const float *points, uint32_t num_points);
+
+    // distances may be null, otherwise the dataset must be stored on the server
+    bool search(uint32_t index_id, const float *queries, uint32_t num_queries, uint32_t top_k,
+                long *ids, float *distances = nullptr);
+
+    // Pipelined requests, each returns its request id (0 if sending failed)
+    uint32_t send_info(uint32_t index_id);
+
+    uint32_t send_add(uint32_t index_id, const float *points, uint32_t num_points, uint64_t dimension);
+
+    uint32_t send_search(uint32_t index_id, const float *queries, uint32_t num_queries, uint64_t dimension,
+                         uint32_t top_k, bool with_distance);
+
+    // Waits for the response to request_id, buffering any other response that
+    // arrives first. A request_id of 0 returns the next response of any request.
+    bool receive(Response &response, uint32_t request_id = 0);
+
+    const std::string &last_error() const;
+
+  private:
+    int fd = -1;
+    uint32_t next_request_id = 1;
+    std::map<uint32_t, Response> early_responses;
+    std::map<uint32_t, uint64_t> dimensions; /// cached by index id
+    std::string error;
+
+    uint32_t send_request(protocol::Writer &request, uint32_t request_id);
+
+    protocol::Writer header(uint8_t opcode, uint32_t request_id, uint32_t index_id);
+
+    bool read_response(Response &response);
+
+    uint64_t dimension_of(uint32_t index_id);
+  };
+
+} //end namespace flinng
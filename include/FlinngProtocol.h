@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace flinng {
+  namespace protocol {
+
+    // Every message is a frame: a uint32 payload length followed by the payload.
+    // Values are in host byte order since both ends share a machine.
+    //
+    // Request payload:  uint8 opcode, uint32 request_id, uint32 index_id, body
+    //   INFO:                  (empty)
+    //   ADD:                   uint32 num_points, float points[num_points * dim]
+    //   SEARCH:                uint32 num_queries, uint32 top_k, float queries[num_queries * dim]
+    //   SEARCH_WITH_DISTANCE:  same as SEARCH
+    //
+    // Response payload: uint8 status, uint8 opcode, uint32 request_id, body
+    //   ERROR status:          uint32 length, char message[length]
+    //   INFO:                  uint64 dimension, uint64 num_points, uint8 stores_dataset
+    //   ADD:                   uint64 num_points (after the add)
+    //   SEARCH:                uint32 num_queries, uint32 top_k, int64 ids[num_queries * top_k]
+    //   SEARCH_WITH_DISTANCE:  as SEARCH, followed by float distances[num_queries * top_k]
+    //
+    // Requests may be pipelined; responses can arrive out of order and are
+    // matched by request_id.
+    enum Opcode : uint8_t {
+      INFO = 1,
+      ADD = 2,
+      SEARCH = 3,
+      SEARCH_WITH_DISTANCE = 4
+    };
+
+    enum Status : uint8_t {
+      OK = 0,
+      ERROR = 1
+    };
+
+    const uint32_t max_frame_size = 1u << 30;
+
+    class Writer {
+
+    public:
+      template<typename T>
+      void put(const T &value) {
+        put_array(&value, 1);
+      }
+
+      template<typename T>
+      void put_array(const T *values, uint64_t count) {
+        uint64_t offset = buffer.size();
+        buffer.resize(offset + count * sizeof(T));
+        if (count > 0) {
+          memcpy(buffer.data() + offset, values, count * sizeof(T));
+        }
+      }
+
+      const std::vector<uint8_t> &data() const { return buffer; }
+
+    private:
+      std::vector<uint8_t> buffer;
+    };
+
+    class Reader {
+
+    public:
+      explicit Reader(const std::vector<uint8_t> &buffer) : pos(buffer.data()), left(buffer.size()) {}
+
+      template<typename T>
+      bool get(T &value) {
+        return get_array(&value, 1);
+      }
+
+      template<typename T>
+      bool get_array(T *values, uint64_t count) {
+        if (count * sizeof(T) > left) {
+          return false;
+        }
+        memcpy(values, pos, count * sizeof(T));
+        pos += count * sizeof(T);
+        left -= count * sizeof(T);
+        return true;
+      }
+
+      uint64_t remaining() const { return left; }
+
+    private:
+      const uint8_t *pos;
+      uint64_t left;
+    };
+
+    // Blocking frame I/O on a connected socket, false on error or end of stream
+    bool send_frame(int fd, const std::vector<uint8_t> &payload);
+
+    bool recv_frame(int fd, std::vector<uint8_t> &payload);
+
+  } //end namespace protocol
+} //end namespace flinng
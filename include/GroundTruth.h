@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace flinng {
+
+  // Exact k nearest neighbors by brute force, parallel over queries. Results
+  // are ordered from nearest to farthest, k per query. Dense points are
+  // compared by L2 distance if l2 is set and by angular distance otherwise.
+  std::vector<uint64_t> brute_force_knn(const float *data, uint64_t num_points, const float *queries,
+                                        uint64_t num_queries, uint64_t dimension, uint32_t k, bool l2);
+
+  // Sparse sets are compared by Jaccard similarity
+  std::vector<uint64_t> brute_force_knn(const std::vector<std::vector<uint64_t>> &data,
+                                        const std::vector<std::vector<uint64_t>> &queries, uint32_t k);
+
+  // Fraction of the first gt_k true neighbors found in the first k results,
+  // averaged over queries. results hold result_stride ids per query and
+  // ground_truth holds gt_stride ids per query.
+  double recall_at_k(const std::vector<uint64_t> &results, uint64_t result_stride,
+                     const std::vector<uint64_t> &ground_truth, uint64_t gt_stride,
+                     uint64_t num_queries, uint32_t k, uint32_t gt_k);
+
+} //end namespace flinng
@@ -25,15 +25,49 @@ parallel_densified_minhash(const std::vector<std::vector<uint64_t>> &points,
                            uint64_t num_tables, uint64_t hashes_per_table,
                            uint8_t hash_range_pow, uint32_t random_seed);
 
+// Multi-probe: with num_probes > 1 every table gets num_probes values, its
+// hash followed by the num_probes - 1 neighboring buckets the point is most
+// likely to have fallen out of, i.e. the hash with its lowest margin SRP bit
+// flipped or its L2 sub hash closest to a bin boundary shifted into the next
+// bin. Slots without such a neighbor hold no_probe.
+const uint64_t no_probe = UINT64_MAX;
+
+void single_srp(uint64_t *result, const float *point, uint64_t data_dimension,
+                const int8_t *random_bits, uint64_t num_tables,
+                uint64_t hashes_per_table, uint64_t num_probes = 1);
+
 std::vector<uint64_t> parallel_srp(const float *dense_data, uint64_t num_points,
                                    uint64_t data_dimension, int8_t *random_bits,
                                    uint64_t num_tables,
-                                   uint64_t hashes_per_table);
+                                   uint64_t hashes_per_table,
+                                   uint64_t num_probes = 1);
+
+// Without bin_offsets and bin_widths, projections are cut into bins of
+// integer width 2 * cutoff / 2^sub_hash_bits centered on 0. With them, the
+// projection of every (table, bit) is shifted by its offset and cut into
+// 2^sub_hash_bits bins of its width, see calibrate_l2_bins.
+void single_l2_lsh(uint64_t *result, const float *point, uint64_t data_dimension,
+                   const int8_t *random_bits, uint64_t num_tables,
+                   uint64_t hashes_per_table, uint64_t sub_hash_bits = 2,
+                   uint64_t cutoff = 6, uint64_t num_probes = 1,
+                   const float *bin_offsets = nullptr, const float *bin_widths = nullptr);
 
 std::vector<uint64_t> parallel_l2_lsh(const float *dense_data, uint64_t num_points,
                                       uint64_t data_dimension, int8_t *random_bits,
                                       uint64_t num_tables,
                                       uint64_t hashes_per_table,
                                       uint64_t sub_hash_bits = 2,
-                                      uint64_t cutoff = 6);
+                                      uint64_t cutoff = 6,
+                                      uint64_t num_probes = 1,
+                                      const float *bin_offsets = nullptr,
+                                      const float *bin_widths = nullptr);
+
+// Fits the bins of every (table, bit) to the projections of sample: the
+// offset is their median and the width spreads the 2^sub_hash_bits bins
+// between the 1 / 2^sub_hash_bits and 1 - 1 / 2^sub_hash_bits quantiles, so
+// bins hold similar shares of the data whatever its scale
+void calibrate_l2_bins(const float *sample, uint64_t num_points, uint64_t data_dimension,
+                       const int8_t *random_bits, uint64_t num_tables, uint64_t hashes_per_table,
+                       uint64_t sub_hash_bits, std::vector<float> &bin_offsets,
+                       std::vector<float> &bin_widths);
 #endif
\ No newline at end of file
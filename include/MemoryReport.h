@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+namespace flinng {
+
+  // Heap bytes held by one part of an index. used counts the elements in use,
+  // reserved the allocated capacity and overhead the vector headers.
+  struct MemoryUsage {
+    uint64_t used = 0, reserved = 0, overhead = 0;
+
+    uint64_t total() const { return reserved + overhead; }
+
+    uint64_t wasted() const { return reserved - used; }
+
+    MemoryUsage &operator+=(const MemoryUsage &other);
+  };
+
+  struct MemoryReport {
+    MemoryUsage posting_lists;   /// inverted index from hashes to cells
+    MemoryUsage cell_membership; /// points of every cell
+    MemoryUsage labels;          /// per point labels for filtered queries
+    MemoryUsage signatures;      /// per point hashes kept for regrouping
+    MemoryUsage rand_bits;       /// projections of dense indexes
+    MemoryUsage bases;           /// stored dataset
+    MemoryUsage numa_replicas;   /// everything above, once per extra NUMA node
+    MemoryUsage stats;           /// FLINNG_ENABLE_STATS posting list read counts
+
+    uint64_t total() const;
+
+    uint64_t wasted() const;
+
+    MemoryReport &operator+=(const MemoryReport &other);
+
+    void print(std::ostream &out) const;
+  };
+
+  template<typename T>
+  MemoryUsage vector_memory(const std::vector<T> &v) {
+    MemoryUsage usage;
+    usage.used = v.size() * sizeof(T);
+    usage.reserved = v.capacity() * sizeof(T);
+    usage.overhead = sizeof(v);
+    return usage;
+  }
+
+  // Headers of the inner vectors count as overhead, including those in the
+  // spare capacity of the outer vector
+  template<typename T>
+  MemoryUsage vector_memory(const std::vector<std::vector<T>> &v) {
+    MemoryUsage usage;
+    usage.overhead = sizeof(v) + v.capacity() * sizeof(std::vector<T>);
+    for (const std::vector<T> &inner: v) {
+      usage.used += inner.size() * sizeof(T);
+      usage.reserved += inner.capacity() * sizeof(T);
+    }
+    return usage;
+  }
+
+  // Reallocates v to exactly its size, unlike shrink_to_fit which may be ignored
+  template<typename T>
+  void shrink_vector(std::vector<T> &v) {
+    if (v.capacity() != v.size()) {
+      std::vector<T>(v.begin(), v.end()).swap(v);
+    }
+  }
+
+} //end namespace flinng
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace flinng {
+
+  struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+  };
+
+  // Parses a sysfs node or cpu list such as "0-3,8-11"
+  std::vector<int> parse_id_list(const std::string &list);
+
+  // Returns the NUMA nodes that have at least one online cpu, read from sysfs.
+  // Falls back to a single node holding every cpu when sysfs is unavailable.
+  std::vector<NumaNode> numa_topology();
+
+  // Pins the calling thread to the cpus of node. Threads it creates afterwards
+  // (including OpenMP workers) inherit the mask, and memory they first touch is
+  // placed on node under the default local allocation policy.
+  bool pin_thread_to_node(const NumaNode &node);
+
+} //end namespace flinng
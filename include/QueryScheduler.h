@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "lib_flinng.h"
+
+namespace flinng {
+
+  // Asynchronous front-end that coalesces single queries submitted from many
+  // threads into batches for BaseDenseFlinng32. A batch is dispatched once it
+  // holds max_batch_size queries or once its oldest query has waited for
+  // max_delay, whichever comes first.
+  class QueryScheduler {
+
+  public:
+    struct Result {
+      std::vector<long> ids;
+      std::vector<float> distances; /// only filled for queries submitted with_distance
+      std::exception_ptr error;     /// set if the batch failed, ids are then empty
+    };
+
+    typedef std::function<void(Result &&)> Callback;
+
+    // with_distance is the default of submissions that do not set it. Queries
+    // submitted with_distance are dispatched to search_with_distance, which
+    // needs the dataset to be stored, along with the rest of their batch.
+    QueryScheduler(BaseDenseFlinng32 &index, uint64_t max_batch_size = 64,
+                   std::chrono::microseconds max_delay = std::chrono::microseconds(500),
+                   bool with_distance = false);
+
+    // Finishes every query and task already submitted
+    ~QueryScheduler();
+
+    // query must hold one point of the index dimension and is copied. The
+    // future rethrows the error of a failed batch.
+    std::future<Result> submit(const float *query, uint32_t top_k);
+
+    // The callback runs on the dispatcher thread and should return quickly.
+    // Exceptions it throws are reported on stderr and dropped.
+    void submit(const float *query, uint32_t top_k, Callback callback);
+
+    // Same as above, with distances only if with_distance is set
+    void submit(const float *query, uint32_t top_k, bool with_distance, Callback callback);
+
+    // Runs task on the dispatcher thread between two batches, e.g. to add
+    // points without racing with queries. The future rethrows what task throws.
+    std::future<void> run_exclusive(std::function<void()> task);
+
+  private:
+    struct Request {
+      std::vector<float> query;
+      uint32_t top_k;
+      bool with_distance;
+      Callback callback;
+      std::function<void()> task; /// set for run_exclusive requests
+      std::chrono::steady_clock::time_point submitted;
+    };
+
+    BaseDenseFlinng32 &index;
+    const uint64_t dimension, max_batch_size;
+    const std::chrono::microseconds max_delay;
+    const bool with_distance;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Request> pending;
+    bool stopping = false;
+    std::thread dispatcher;
+
+    void enqueue(Request &&request);
+
+    void dispatch_loop();
+
+    void run_batch(std::vector<Request> &batch);
+  };
+
+}; //end namespace flinng
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Statistics are only collected when the library is built with
+// FLINNG_ENABLE_STATS (cmake -DFLINNG_ENABLE_STATS=ON). Otherwise the
+// instrumentation compiles out and every counter stays zero.
+#ifdef FLINNG_ENABLE_STATS
+#define FLINNG_STATS(...) __VA_ARGS__
+#else
+#define FLINNG_STATS(...)
+#endif
+
+namespace flinng {
+
+  // Whether the library was built with FLINNG_ENABLE_STATS
+  bool stats_enabled();
+
+  // Counters and phase timings of a single query
+  struct QueryStats {
+    uint64_t tables_probed = 0;           /// posting lists counted, less than num_hash_tables on early stop
+    uint64_t posting_entries_scanned = 0; /// cell ids read from the posting lists
+    uint64_t cells_hit = 0;               /// cells with a nonzero count
+    uint64_t cells_visited = 0;           /// cells whose points were walked
+    uint64_t candidates_resolved = 0;     /// points checked before top_k were found
+    uint32_t final_score = 0;             /// score of the last result
+    uint64_t hash_ns = 0, count_ns = 0, rank_ns = 0, resolve_ns = 0;
+
+    uint64_t total_ns() const { return hash_ns + count_ns + rank_ns + resolve_ns; }
+  };
+
+  // Histogram with power of two buckets that concurrent queries update
+  // without locking. Bucket b holds values in [2^(b-1), 2^b), bucket 0 holds 0.
+  class Histogram {
+
+  public:
+    static const uint32_t num_buckets = 65;
+
+    Histogram();
+
+    void add(uint64_t value);
+
+    void reset();
+
+    uint64_t count() const;
+
+    uint64_t sum() const;
+
+    uint64_t max() const;
+
+    double mean() const;
+
+    // Upper bound of the bucket holding the p quantile, 0 <= p <= 1
+    uint64_t percentile(double p) const;
+
+    uint64_t bucket_count(uint32_t bucket) const;
+
+  private:
+    std::atomic<uint64_t> buckets[num_buckets];
+    std::atomic<uint64_t> total, maximum;
+  };
+
+  // Aggregate of every query run on an index, plus the number of times each
+  // posting list was read
+  class IndexStats {
+
+  public:
+    explicit IndexStats(uint64_t num_posting_lists);
+
+    void record(const QueryStats &stats);
+
+    void count_read(uint64_t posting_list) { reads[posting_list].fetch_add(1, std::memory_order_relaxed); }
+
+    void reset();
+
+    uint64_t num_queries() const { return candidates_resolved.count(); }
+
+    uint64_t posting_list_reads(uint64_t posting_list) const;
+
+    Histogram tables_probed, posting_entries_scanned, cells_hit, cells_visited, candidates_resolved, final_score;
+    Histogram hash_ns, count_ns, rank_ns, resolve_ns, total_ns;
+
+  private:
+    uint64_t num_posting_lists;
+    std::unique_ptr<std::atomic<uint32_t>[]> reads;
+  };
+
+  // A posting list ranked by the number of entries queries scanned in it
+  struct HotBucket {
+    uint64_t table, hash;
+    uint64_t length;           /// cell ids in the posting list
+    uint64_t reads;            /// queries that read it
+    uint64_t entries_scanned;  /// length * reads
+  };
+
+  inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+} //end namespace flinng
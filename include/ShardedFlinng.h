@@ -0,0 +1,94 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "lib_flinng.h"
+
+namespace flinng {
+
+  // Partitions points across independent FLINNG shards. All shards share the
+  // same hash functions, so a query batch is hashed once and then fanned out
+  // to every shard in parallel. Each shard has its own cells_per_row, and new
+  // points are spread proportionally to it.
+  class ShardedDenseFlinng32 {
+
+  public:
+    // One shard is created per entry of cells_per_row; every other parameter
+    // is taken from def and is the same for all shards
+    ShardedDenseFlinng32(uint64_t data_dimension, const std::vector<uint64_t> &cells_per_row,
+                         FlinngBuilder *def = nullptr, bool use_l2 = false);
+
+    // Reads a shard set written by write_index
+    static ShardedDenseFlinng32 *from_index(const char *fname);
+
+    void add(float *x, uint64_t num);
+
+    void add_and_store(float *input, uint64_t num_items);
+
+    void finalize_construction();
+
+    // Per-shard candidates are merged by their cell-hit score
+    void search(float *queries, unsigned n, unsigned k, long *ids);
+
+    // Per-shard candidates are merged by exact distance, the dataset must be
+    // stored with add_and_store
+    void search_with_distance(float *queries, unsigned n, unsigned k, long *ids, float *distances);
+
+    // Writes a manifest to fname and each shard to fname.shard<i>
+    void write_index(const char *fname);
+
+    uint64_t num_shards() const;
+
+    uint64_t num_points_added() const;
+
+  private:
+    ShardedDenseFlinng32() {}
+
+    std::vector<std::unique_ptr<BaseDenseFlinng32>> shards;
+    std::vector<uint64_t> shard_cells;
+    std::vector<std::vector<uint64_t>> shard_ids; /// global id of every shard-local point
+    uint64_t data_dimension = 0, total_points_added = 0;
+
+    void add_to_shards(float *input, uint64_t num_items, bool store);
+  };
+
+  class ShardedSparseFlinng32 {
+
+  public:
+    ShardedSparseFlinng32(uint64_t num_rows, const std::vector<uint64_t> &cells_per_row,
+                          uint64_t num_hash_tables, uint64_t hashes_per_table,
+                          uint64_t hash_range_pow);
+
+    static ShardedSparseFlinng32 *from_index(const char *fname);
+
+    void addPointsSameDim(const uint64_t *points, uint64_t num_points, uint64_t point_dimension);
+
+    void addPoints(const std::vector<std::vector<uint64_t>> &data);
+
+    void prepareForQueries();
+
+    // Per-shard candidates are merged by their cell-hit score
+    std::vector<uint64_t> query(const std::vector<std::vector<uint64_t>> &queries, uint64_t top_k);
+
+    std::vector<uint64_t>
+    querySameDim(const std::vector<uint64_t> &queries, uint64_t num_points, uint64_t point_dimension, uint64_t top_k);
+
+    void write_index(const char *fname);
+
+    uint64_t num_shards() const;
+
+    uint64_t num_points_added() const;
+
+  private:
+    ShardedSparseFlinng32() {}
+
+    std::vector<std::unique_ptr<SparseFlinng32>> shards;
+    std::vector<uint64_t> shard_cells;
+    std::vector<std::vector<uint64_t>> shard_ids;
+    uint64_t total_points_added = 0;
+
+    std::vector<uint64_t> query_hashes(const std::vector<uint64_t> &hashes, uint64_t top_k);
+  };
+
+}; //end namespace flinng
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lib_flinng.h"
+
+namespace flinng {
+
+  // Builds a dense index that does not fit in memory. Points are hashed in
+  // chunks, and every chunk is spilled to a run file with one sorted posting
+  // section per table plus its cell memberships. write_index merges the runs
+  // in levels of at most max_open_runs until that many are left, then merges
+  // those straight into the format read by BaseDenseFlinng32::from_index.
+  // Peak memory and open files are bounded by chunk_size and max_open_runs,
+  // not by the dataset size.
+  class StreamingIndexBuilder {
+
+  public:
+    // index defines the type, parameters and hash functions of the output and
+    // must be empty, with a hash range and number of cells of at most 2^32
+    // each. Run files are created in tmp_dir, named uniquely per builder, and
+    // removed by write_index. If store is set, the vectors are kept in the
+    // output as with add_and_store.
+    StreamingIndexBuilder(BaseDenseFlinng32 &index, const char *tmp_dir,
+                          uint64_t chunk_size = (1 << 14), bool store = false, uint64_t max_open_runs = 64);
+
+    ~StreamingIndexBuilder();
+
+    // Streams every vector of fname through add
+    void add_file(const char *fname, VectorFormat format, uint64_t dimension = 0);
+
+    // Hashes and spills num_points points, in runs of at most chunk_size
+    void add(const float *points, uint64_t num_points);
+
+    // Writes to fname.partial and renames it to fname once complete. On
+    // failure the partial file is removed and the runs are kept, so
+    // write_index can be retried. Once it succeeds the builder is finished and
+    // neither add nor write_index can be called again.
+    void write_index(const char *fname);
+
+    uint64_t num_points_added() const;
+
+  private:
+    struct Run {
+      std::string fname;
+      uint64_t num_points;
+      std::vector<uint64_t> table_sizes; /// number of posting entries per table
+    };
+
+    BaseDenseFlinng32 &index;
+    std::string file_prefix; /// tmp_dir and a name unique to this builder
+    uint64_t chunk_size;
+    bool store;
+    uint64_t max_open_runs;
+    uint64_t total_points_added = 0;
+    uint64_t next_run = 0;
+    bool finished = false; /// set once write_index succeeded
+    std::vector<Run> runs;
+    std::string bases_fname;
+    std::unique_ptr<FileIO> bases_file;
+
+    void spill(const float *points, uint64_t num_points);
+
+    std::string run_file_name();
+
+    // Replaces each group of max_open_runs runs by one merged run, returns
+    // false if a merge failed, in which case runs still covers every point
+    bool merge_level();
+
+    bool merge_runs(uint64_t first, uint64_t last, Run &merged);
+
+    void remove_tmp_files();
+  };
+
+}; //end namespace flinng
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace flinng {
+
+  // Persistent pool of worker threads with work-stealing. Unlike an OpenMP
+  // parallel for, workers stay alive between calls, so small batches do not
+  // pay for forking a team, and skewed iterations are rebalanced by stealing.
+  class ThreadPool {
+
+  public:
+    // The calling thread takes part in every parallel_for, so num_threads - 1
+    // background workers are started. Each of them runs init with its id, from
+    // 1 to num_threads - 1, before taking any work, e.g. to pin itself.
+    explicit ThreadPool(unsigned num_threads, std::function<void(unsigned id)> init = nullptr);
+
+    ~ThreadPool();
+
+    unsigned num_threads() const;
+
+    // Runs fn(i) for every i in [begin, end) and returns once all calls are
+    // done. Each thread starts with a contiguous block of the range and steals
+    // half of another thread's remaining block when it runs out. Calls made
+    // from inside a task run sequentially on the calling worker. If fn throws,
+    // the calls not yet started are skipped and the first exception is
+    // rethrown once every thread has left the loop.
+    void parallel_for(uint64_t begin, uint64_t end, const std::function<void(uint64_t)> &fn);
+
+  private:
+    // [lo, hi) packed as (lo << 32 | hi) so that it can be popped and stolen
+    // with a single compare-and-swap. Padded to a cache line to avoid false
+    // sharing between threads
+    struct WorkRange {
+      std::atomic<uint64_t> range{0};
+      char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    std::function<void(unsigned id)> init;
+    std::vector<std::thread> workers;
+    std::unique_ptr<WorkRange[]> ranges;
+    unsigned size;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    const std::function<void(uint64_t)> *job = nullptr;
+    uint64_t job_offset = 0;
+    std::atomic<uint64_t> remaining{0};
+    std::atomic<unsigned> active{0};
+    std::mutex job_mutex; /// serializes concurrent callers
+    std::atomic<bool> failed{false};
+    std::exception_ptr error; /// first exception thrown by the current job
+    std::mutex error_mutex;
+
+    void worker_loop(unsigned id);
+
+    void run_tasks(unsigned id);
+
+    bool pop(unsigned id, uint64_t &item);
+
+    bool steal(unsigned thief);
+  };
+
+  // Runs fn(i) for every i in [0, n) on pool, or with an OpenMP parallel for
+  // when pool is null
+  template<typename F>
+  void parallel_for(ThreadPool *pool, uint64_t n, const F &fn) {
+    if (pool != nullptr) {
+      pool->parallel_for(0, n, fn);
+      return;
+    }
+#pragma omp parallel for
+    for (uint64_t i = 0; i < n; i++) {
+      fn(i);
+    }
+  }
+
+} //end namespace flinng
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "lib_flinng.h"
+
+namespace flinng {
+
+  // What the tuned index has to deliver on the full dataset
+  struct TuningGoal {
+    uint32_t k = 10;
+    double target_recall = 0.9;  /// recall@k
+    uint64_t memory_budget = 0;  /// bytes of the full index, 0 is unlimited
+    uint64_t full_size = 0;      /// points of the full dataset, 0 is the sample size
+    bool l2 = false;             /// L2DenseFlinng32 instead of DenseFlinng32
+    bool calibrate_bins = false; /// L2 only, see FlinngBuilder::calibrate_bins
+  };
+
+  // Parameters tried by tune_parameters, every combination once. Cells are
+  // given as points per cell rather than cells_per_row, since recall mostly
+  // depends on how many points a cell holds and this carries over from the
+  // sample to the full dataset.
+  struct TuningSpace {
+    std::vector<uint64_t> num_rows = {2, 3, 4};
+    std::vector<uint64_t> points_per_cell = {25, 100, 400};
+    std::vector<uint64_t> num_hash_tables = {16, 64, 256};
+    std::vector<uint64_t> hashes_per_table = {8, 12, 16};
+    std::vector<uint64_t> sub_hash_bits = {2}; /// L2 only
+    uint64_t max_posting_lists = 1 << 26;      /// larger hash ranges are skipped
+  };
+
+  struct TuningCandidate {
+    FlinngBuilder spec;              /// sized for the full dataset
+    double recall = 0;               /// measured on the sample
+    double sample_qps = 0;
+    double projected_qps = 0;        /// extrapolated to the full dataset
+    uint64_t sample_memory = 0;
+    uint64_t projected_memory = 0;   /// bytes, extrapolated to the full dataset, without stored vectors
+    bool skipped = false;            /// too many posting lists or over budget before building
+    bool meets_goal = false;
+  };
+
+  struct TuningResult {
+    FlinngBuilder spec;    /// the recommended parameters, calibrate_bins included
+    bool meets_goal = false;
+    std::vector<TuningCandidate> candidates;
+
+    void print(std::ostream &out) const;
+  };
+
+  // Builds an index for every combination in space on sample, queries it with
+  // the held-out queries and returns the candidate with the highest projected
+  // QPS among those reaching goal.target_recall within goal.memory_budget.
+  // If none does, the one with the best recall within budget is returned, or
+  // the smallest one if none fits. Indexes are built in parallel, one per
+  // thread, and timed one at a time with every thread. Recall is assumed to
+  // stay put at the full size, the cost of counting, ranking and resolving
+  // and the memory of the posting lists and cells to grow linearly with it.
+  // Recall is thus only measured against the sample's own neighbors, and the
+  // projected memory leaves out the dataset, which an index storing it adds
+  // at full_size * dimension * 4 bytes. With goal.calibrate_bins the
+  // candidates fit their L2 bins to the sample, as the full index will to its
+  // first add.
+  TuningResult tune_parameters(const float *sample, uint64_t num_points, const float *queries,
+                               uint64_t num_queries, uint64_t dimension, const TuningGoal &goal,
+                               const TuningSpace &space = TuningSpace());
+
+} //end namespace flinng
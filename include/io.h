@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 #include <string.h>
+#include <vector>
 
 namespace flinng {
   struct FileIO {
@@ -12,4 +14,37 @@ namespace flinng {
 
     ~FileIO();
   };
+
+  enum class VectorFormat {
+    fvecs,  /// each vector is an int32 dimension followed by that many float32
+    bvecs,  /// each vector is an int32 dimension followed by that many uint8
+    float32 /// headerless float32 vectors, the dimension must be given
+  };
+
+  // Reads dense vectors from a file in chunks of bounded size
+  class VectorFileReader {
+  public:
+    VectorFileReader(const char *fname, VectorFormat format, uint64_t dimension = 0);
+
+    bool good() const;
+
+    uint64_t dimension() const;
+
+    // Replaces the content of chunk with at most max_points vectors, returns
+    // the number of vectors read (0 at the end of the file)
+    uint64_t read(std::vector<float> &chunk, uint64_t max_points);
+
+  private:
+    FileIO file;
+    VectorFormat format;
+    uint64_t dim;
+  };
+
+  // Reads a whole ivecs file (e.g. ground truth neighbor ids), every vector
+  // must have the same dimension
+  bool read_ivecs(const char *fname, std::vector<int32_t> &values, uint64_t &dimension);
+
+  // Reads sparse sets, one per line as whitespace separated non-negative
+  // integer ids. "id:value" entries (libsvm style) keep only the id.
+  bool read_sparse_vectors(const char *fname, std::vector<std::vector<uint64_t>> &points);
 } //end namespace flinng
@@ -3,11 +3,13 @@
 #include <chrono>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "Flinng.h"
 #include "LshFunctions.h"
+#include "NumaTopology.h"
 #include "io.h"
 
 namespace flinng {
@@ -16,6 +18,27 @@ namespace flinng {
 
   void read_verify(void *ptr, size_t size, size_t count, FileIO &file);
 
+  // Index files may end with optional sections, each a uint32 tag, the uint64
+  // size of its payload in bytes and the payload, terminated by END_SECTION.
+  // Readers skip the sections they do not know, and files written before
+  // sections existed end where the first tag would be, so both stay readable.
+  enum SectionTag : uint32_t {
+    END_SECTION = 0,
+    LABELS_SECTION = 1,
+    BUCKET_STATS_SECTION = 2, /// no longer written, bucket statistics are recomputed on load
+    BUCKET_BALANCE_SECTION = 3,
+    SPLIT_PROJECTIONS_SECTION = 4,
+    L2_CALIBRATION_SECTION = 5,
+    SIGNATURES_SECTION = 6
+  };
+
+  void write_section_header(FileIO &file, uint32_t tag, uint64_t size);
+
+  // Calls read for every section until END_SECTION or the end of the file.
+  // read consumes the payload and returns true, or returns false for tags it
+  // does not know, which are then skipped.
+  void read_sections(FileIO &file, const std::function<bool(uint32_t tag, uint64_t size)> &read);
+
   class FlinngBuilder {
 
   public:
@@ -25,24 +48,35 @@ namespace flinng {
     uint64_t hashes_per_table;
     uint64_t sub_hash_bits; //sub_hash_bits * hashes_per_table must be less than 32, otherwise segfault will happen
     uint64_t cut_off;
+    bool calibrate_bins; //L2 only, fits the bins to the data on the first add, cut_off is then unused if it does
 
 
     FlinngBuilder(uint64_t num_rows = 3, uint64_t cells_per_row = (1 << 12),
                   uint64_t num_hash_tables = (1 << 9), uint64_t hashes_per_table = 14,
-                  uint64_t sub_hash_bits = 2, uint64_t cut_off = 6)
+                  uint64_t sub_hash_bits = 2, uint64_t cut_off = 6, bool calibrate_bins = false)
         : num_rows(num_rows), cells_per_row(cells_per_row), num_hash_tables(num_hash_tables),
           hashes_per_table(hashes_per_table), sub_hash_bits(sub_hash_bits),
-          cut_off(cut_off) {}
+          cut_off(cut_off), calibrate_bins(calibrate_bins) {}
   };
 
 
+  class ShardedDenseFlinng32;
+
+  class ShardedSparseFlinng32;
+
+  class StreamingIndexBuilder;
+
   class BaseDenseFlinng32 {
+    friend class ShardedDenseFlinng32;
+    friend class StreamingIndexBuilder;
 
   public:
     BaseDenseFlinng32(uint64_t num_rows, uint64_t cells_per_row,
                       uint64_t data_dimension, uint64_t num_hash_tables,
                       uint64_t hashes_per_table, uint64_t hash_range);
 
+    virtual ~BaseDenseFlinng32() = default;
+
     static BaseDenseFlinng32 *from_index(const char *fname);
 
     void addPoints(const std::vector<float> &points);
@@ -55,6 +89,16 @@ namespace flinng {
 
     std::vector<uint64_t> query(float *queries, uint64_t num_queries, uint32_t top_k);
 
+    // Same as above and fills stats with the counters and phase timings of
+    // every query, which are all zero unless built with FLINNG_ENABLE_STATS
+    std::vector<uint64_t> query(float *queries, uint64_t num_queries, uint32_t top_k,
+                                std::vector<QueryStats> &stats);
+
+    // Same as the first query, trading recall for latency as set by options.
+    // Tables that are not probed are not hashed either.
+    std::vector<uint64_t> query(float *queries, uint64_t num_queries, uint32_t top_k,
+                                const QueryOptions &options);
+
     void finalize_construction();
 
     void add(float *x, uint64_t num);
@@ -63,23 +107,130 @@ namespace flinng {
 
     void search(float *queries, unsigned n, unsigned k, long *ids);
 
+    // Same as search, trading recall for latency or filtering by label as set
+    // by options. Missing results are set to -1.
+    void search(float *queries, unsigned n, unsigned k, long *ids, const QueryOptions &options);
+
+    // Missing results are set to -1 at the maximum distance
     void search_with_distance(float *queries, unsigned n, unsigned k, long *ids, float *distances);
 
+    // Sets the labels that QueryOptions::filter selects by, see Flinng::set_labels
+    void set_labels(uint64_t first_point, const uint32_t *labels, uint64_t num_points);
+
+    uint32_t label(uint64_t point) const;
+
     void write_index(const char *fname);
 
     void fetch_descriptors(long id, float *desc);
 
+    // On the thread pool if set_num_threads started one
+    std::vector<uint64_t> hashPoints(const float *points, uint64_t num_points);
+
+    uint64_t num_points_added() const;
+
+    uint64_t dimension() const;
+
+    // Whether every point was added with add_and_store
+    bool stores_dataset() const;
+
+    // Appends every point of other without rehashing. other must be of the
+    // same type with identical hash parameters and rand_bits, e.g. both loaded
+    // with from_index from the same empty index. Stored vectors are merged too,
+    // so either both or neither must store their dataset. L2 indexes that
+    // calibrate their bins each fit them to their own first add, so calibrate
+    // the empty index once before copying it, see L2DenseFlinng32::calibrate.
+    void merge(const BaseDenseFlinng32 &other);
+
+    // Replicates the query structures (index, cell membership and stored
+    // vectors) onto every NUMA node and runs queries on a persistent pool with
+    // one worker per cpu, pinned to its node, that queries the replica of its
+    // node. Costs one copy of the index per node; replicas are refreshed by
+    // prepareForQueries. Query options and set_num_threads are served by the
+    // same workers. Does nothing on single node machines.
+    void enable_numa_replication();
+
+    // Same as above onto nodes, e.g. a subset of numa_topology()
+    void enable_numa_replication(const std::vector<NumaNode> &nodes);
+
+    void disable_numa_replication();
+
+    // Runs this index on a persistent work-stealing pool of num_threads
+    // threads instead of OpenMP. Each query is hashed and ranked in a single
+    // task, which keeps small batches close to single query latency.
+    // 0 goes back to OpenMP.
+    void set_num_threads(unsigned num_threads);
+
+    // Bytes held by the index, its projections, stored vectors and NUMA replicas
+    MemoryReport memory_report() const;
+
+    // Releases the spare capacity of the index and stored vectors, see
+    // Flinng::compact. NUMA replicas are copies and hold none.
+    void compact();
+
+    // See Flinng::query_stats and Flinng::hot_buckets
+    const IndexStats *query_stats() const;
+
+    void reset_query_stats();
+
+    std::vector<HotBucket> hot_buckets(uint64_t count) const;
+
+    // Sets the policy for oversized posting lists, see BucketBalance. The split
+    // policy rehashes the stored dataset with split_bits extra SRP bits per
+    // table, so it requires add_and_store and must be applied again after
+    // adding or merging points.
+    void balance_buckets(const BucketBalance &balance);
+
+    const BucketStats &bucket_stats() const;
+
+    // See Flinng::store_signatures and Flinng::regroup. Regrouping needs
+    // neither the stored dataset nor any hashing.
+    void store_signatures(bool store);
+
+    bool stores_signatures() const;
+
+    void regroup(uint64_t num_rows, uint64_t cells_per_row);
+
   protected:
     BaseDenseFlinng32();
 
+    struct NumaReplica {
+      NumaNode node;
+      std::unique_ptr<Flinng> flinng;
+      std::vector<float> bases;
+    };
+
     Flinng internal_flinng;
     uint64_t num_hash_tables, hashes_per_table, data_dimension;
     std::vector<int8_t> rand_bits;
+    std::vector<int8_t> split_rand_bits; /// split_bits projections per table, set by balance_buckets
 
     std::vector<float> bases; /// database vectors, size ntotal * dimension
 
+    bool numa_enabled = false;
+    std::vector<NumaNode> numa_nodes;
+    std::vector<NumaReplica> numa_replicas;
+    std::unique_ptr<ThreadPool> numa_pool; /// workers pinned to numa_nodes
+
+    std::shared_ptr<ThreadPool> thread_pool;
+
+    void build_numa_replicas();
+
+    // The pool queries run on, numa_pool while the replicas are current
+    ThreadPool *query_pool() const;
+
+    // The replica of the calling numa_pool worker, null on any other thread
+    NumaReplica *local_replica();
+
+    // stats and options may be null
+    std::vector<uint64_t> query_with_stats(float *queries, uint64_t num_queries, uint32_t top_k,
+                                           QueryStats *stats, const QueryOptions *options = nullptr);
+
     void write_content_to_index(FileIO &index);
 
+    // Hash parameters and rand_bits, written between the Flinng content and
+    // the stored vectors
+    void write_hash_content_to_index(FileIO &index);
+
     void read_content_from_index(FileIO &index);
 
     static bool read_type_from_index(FileIO &index);
@@ -90,9 +241,35 @@ namespace flinng {
 
     virtual void read_additional_content_from_index(FileIO &index) {}
 
+    // Sections written after the additional content, see write_section_header.
+    // Overrides should call these to keep the sections of internal_flinng.
+    virtual void write_sections_to_index(FileIO &index);
+
+    virtual bool read_section_from_index(FileIO &index, uint32_t tag, uint64_t size);
+
     virtual float compute_distance(float *a, float *b) = 0;
 
     virtual std::vector<uint64_t> getHashes(const float *points, uint64_t num_points) = 0;
+
+    // Hashes a single point for tables [first_table, first_table + num_tables),
+    // num_probes values per table, without spawning threads
+    virtual void hashPoint(const float *point, uint64_t *result, uint64_t first_table, uint64_t num_tables,
+                           uint64_t num_probes) = 0;
+
+    virtual bool has_same_hashes(const BaseDenseFlinng32 &other) const;
+
+    // Called with the points of the first add, before they are hashed
+    virtual void calibrate_hashes(const float *sample, uint64_t num_points) {}
+
+    uint64_t split_extra(const float *point, uint64_t table) const;
+
+    // Encodes the extra bits of split buckets into the hashes, num_probes per
+    // table, of tables [first_table, first_table + num_tables)
+    void add_split_bits(const float *point, uint64_t *hashes, uint64_t first_table, uint64_t num_tables,
+                        uint64_t num_probes) const;
+
+    // getHashes with the extra bits of split buckets
+    std::vector<uint64_t> getQueryHashes(const float *points, uint64_t num_points);
   };
 
   class DenseFlinng32 : public BaseDenseFlinng32 {
@@ -111,6 +288,12 @@ namespace flinng {
       return parallel_srp(points, num_points, data_dimension, rand_bits.data(), num_hash_tables, hashes_per_table);
     }
 
+    inline void hashPoint(const float *point, uint64_t *result, uint64_t first_table, uint64_t num_tables,
+                          uint64_t num_probes) override {
+      single_srp(result, point, data_dimension, rand_bits.data() + first_table * hashes_per_table * data_dimension,
+                 num_tables, hashes_per_table, num_probes);
+    }
+
     void write_type_to_index(FileIO &index) override;
   };
 
@@ -120,11 +303,31 @@ namespace flinng {
     L2DenseFlinng32();
     L2DenseFlinng32(uint64_t num_rows, uint64_t cells_per_row,
                     uint64_t data_dimension, uint64_t num_hash_tables,
-                    uint64_t hashes_per_table, uint64_t sub_hash_bits = 2, uint64_t cutoff = 6);
+                    uint64_t hashes_per_table, uint64_t sub_hash_bits = 2, uint64_t cutoff = 6,
+                    bool calibrate_bins = false);
 
     L2DenseFlinng32(uint64_t data_dimension, FlinngBuilder *def = nullptr);
+
+    // Fewer points give quantiles too coarse to place the bins by
+    static const uint64_t min_calibration_points = 256;
+
+    // Fits the hash bins to sample, which must hold at least
+    // min_calibration_points points, see calibrate_l2_bins. With
+    // calibrate_bins this happens on the first add, or never if that add is
+    // smaller. Calling it explicitly on an empty index lets indexes later
+    // merged, e.g. copies of it written with write_index, share their bins.
+    void calibrate(const float *sample, uint64_t num_points);
+
+    bool is_calibrated() const;
+
+    // Whether calibrate_bins was set but the first add held fewer than
+    // min_calibration_points points, so the fixed bins are kept
+    bool calibration_skipped() const;
+
   protected:
     uint64_t sub_hash_bits, cutoff;
+    bool calibrate_bins;
+    std::vector<float> bin_offsets, bin_widths; /// per (table, bit), empty until calibrated
 
     L2DenseFlinng32(uint64_t data_dimension, FlinngBuilder &&def);
 
@@ -136,20 +339,50 @@ namespace flinng {
 
     float compute_distance(float *a, float *b) override;
 
+    bool has_same_hashes(const BaseDenseFlinng32 &other) const override;
+
+    void calibrate_hashes(const float *sample, uint64_t num_points) override;
+
+    void write_sections_to_index(FileIO &index) override;
+
+    bool read_section_from_index(FileIO &index, uint32_t tag, uint64_t size) override;
+
     inline std::vector<uint64_t> getHashes(const float *points, uint64_t num_points) override {
       return parallel_l2_lsh(points, num_points, data_dimension,
                              rand_bits.data(), num_hash_tables, hashes_per_table,
-                             sub_hash_bits, cutoff);
+                             sub_hash_bits, cutoff, 1, bin_offsets_of(0), bin_widths_of(0));
+    }
+
+    inline void hashPoint(const float *point, uint64_t *result, uint64_t first_table, uint64_t num_tables,
+                          uint64_t num_probes) override {
+      single_l2_lsh(result, point, data_dimension, rand_bits.data() + first_table * hashes_per_table * data_dimension,
+                    num_tables, hashes_per_table, sub_hash_bits, cutoff, num_probes,
+                    bin_offsets_of(first_table), bin_widths_of(first_table));
+    }
+
+    const float *bin_offsets_of(uint64_t table) const {
+      return bin_offsets.empty() ? nullptr : bin_offsets.data() + table * hashes_per_table;
+    }
+
+    const float *bin_widths_of(uint64_t table) const {
+      return bin_widths.empty() ? nullptr : bin_widths.data() + table * hashes_per_table;
     }
   };
 
   class SparseFlinng32 {
+    friend class ShardedSparseFlinng32;
 
   public:
     SparseFlinng32(uint64_t num_rows, uint64_t cells_per_row,
                    uint64_t num_hash_tables, uint64_t hashes_per_table,
                    uint64_t hash_range_pow);
 
+    SparseFlinng32(uint64_t num_rows, uint64_t cells_per_row,
+                   uint64_t num_hash_tables, uint64_t hashes_per_table,
+                   uint64_t hash_range_pow, uint32_t seed);
+
+    static SparseFlinng32 *from_index(const char *fname);
+
     void addPointsSameDim(const uint64_t *points, uint64_t num_points, uint64_t point_dimension);
 
     void addPointsSameDim(const std::vector<uint64_t> &points, uint64_t num_points, uint64_t point_dimension);
@@ -162,13 +395,60 @@ namespace flinng {
 
     std::vector<uint64_t> query(const std::vector<std::vector<uint64_t>> &queries, uint64_t top_k);
 
+    // Densified minhashes depend on each other, so every table is still hashed,
+    // and there are no margins to derive probes from, so num_probes is ignored
+    std::vector<uint64_t> query(const std::vector<std::vector<uint64_t>> &queries, uint64_t top_k,
+                                const QueryOptions &options);
+
     std::vector<uint64_t>
     querySameDim(const std::vector<uint64_t> &queries, uint64_t num_points, uint64_t point_dimension, uint64_t top_k);
 
+    uint64_t num_points_added() const;
+
+    // Appends every point of other, which must use the same seed and hash
+    // parameters
+    void merge(const SparseFlinng32 &other);
+
+    // See Flinng::set_labels, filtered queries go through QueryOptions::filter
+    void set_labels(uint64_t first_point, const uint32_t *labels, uint64_t num_points);
+
+    uint32_t label(uint64_t point) const;
+
+    void write_index(const char *fname);
+
+    // Same as BaseDenseFlinng32::set_num_threads
+    void set_num_threads(unsigned num_threads);
+
+    MemoryReport memory_report() const;
+
+    void compact();
+
+    const IndexStats *query_stats() const;
+
+    void reset_query_stats();
+
+    std::vector<HotBucket> hot_buckets(uint64_t count) const;
+
+    // Same as BaseDenseFlinng32::balance_buckets, except that buckets cannot
+    // be split
+    void balance_buckets(const BucketBalance &balance);
+
+    const BucketStats &bucket_stats() const;
+
+    void store_signatures(bool store);
+
+    bool stores_signatures() const;
+
+    void regroup(uint64_t num_rows, uint64_t cells_per_row);
+
   protected:
     Flinng internal_flinng;
     const uint64_t num_hash_tables, hashes_per_table, hash_range_pow;
     const uint32_t seed;
+    std::shared_ptr<ThreadPool> thread_pool;
+
+    std::vector<uint64_t> queryPoints(const uint64_t *const *points, const uint64_t *point_lens,
+                                      uint64_t num_points, uint64_t top_k);
 
     inline std::vector<uint64_t> getHashes(const uint64_t *points, uint64_t num_points, uint64_t point_dimension) {
       return parallel_densified_minhash(points, num_points, point_dimension, num_hash_tables, hashes_per_table,
@@ -1,4 +1,6 @@
+#include <cmath>
 #include <iostream>
+#include <iterator>
 #include "Flinng.h"
 #include "lib_flinng.h"
 
@@ -7,13 +9,19 @@ uint64_t hash_range)
 : num_rows(num_rows), cells_per_row(cells_per_row),
 num_hash_tables(num_hashes), hash_range(hash_range),
 inverted_flinng_index(hash_range * num_hashes),
-cell_membership(num_rows * cells_per_row) {}
+cell_membership(num_rows * cells_per_row) {
+  FLINNG_STATS(index_stats.reset(new flinng::IndexStats(hash_range * num_hashes)));
+}
 
 // All the hashes for point 1 come first, etc.
 // Size of hashes should be multiple of num_hash_tables
 void Flinng::addPoints(const std::vector<uint64_t> &hashes) {
 
+  split_lists.clear();
   uint64_t num_points = hashes.size() / num_hash_tables;
+  if (keep_signatures) {
+    signatures.insert(signatures.end(), hashes.begin(), hashes.begin() + num_points * num_hash_tables);
+  }
   std::vector<uint64_t> random_buckets(num_rows * num_points);
   for (uint64_t i = 0; i < num_rows * num_points; i++) {
     random_buckets[i] =
@@ -21,8 +29,7 @@ void Flinng::addPoints(const std::vector<uint64_t> &hashes) {
         (i % num_rows) * cells_per_row;
   }
 
-#pragma omp parallel for
-  for (uint64_t table = 0; table < num_hash_tables; table++) {
+  flinng::parallel_for(thread_pool.get(), num_hash_tables, [&](uint64_t table) {
     for (uint64_t point = 0; point < num_points; point++) {
       uint64_t hash = hashes[point * num_hash_tables + table];
       uint64_t hash_id = table * hash_range + hash;
@@ -31,7 +38,7 @@ void Flinng::addPoints(const std::vector<uint64_t> &hashes) {
             random_buckets[point * num_rows + row]);
       }
     }
-  }
+  });
 
   for (uint64_t point = 0; point < num_points; point++) {
     for (uint64_t row = 0; row < num_rows; row++) {
@@ -41,6 +48,9 @@ void Flinng::addPoints(const std::vector<uint64_t> &hashes) {
   }
 
   total_points_added += num_points;
+  if (!labels.empty()) {
+    labels.resize(total_points_added, 0);
+  }
 
   prepareForQueries();
 }
@@ -54,6 +64,26 @@ void Flinng::prepareForQueries() {
                     inverted_flinng_index[i].end()),
         inverted_flinng_index[i].end());
   }
+  update_bucket_stats();
+}
+
+void Flinng::update_bucket_stats() {
+  buckets = flinng::BucketStats();
+  buckets.num_lists = inverted_flinng_index.size();
+  for (const std::vector<uint32_t> &list: inverted_flinng_index) {
+    buckets.num_empty += list.empty();
+    buckets.total_entries += list.size();
+    buckets.max_length = std::max<uint64_t>(buckets.max_length, list.size());
+  }
+  double mean = buckets.num_lists == buckets.num_empty
+                ? 0 : static_cast<double>(buckets.total_entries) / (buckets.num_lists - buckets.num_empty);
+  buckets.threshold = std::max<uint64_t>(balance.min_length, balance.oversize_factor * mean);
+  for (const std::vector<uint32_t> &list: inverted_flinng_index) {
+    if (list.size() > buckets.threshold) {
+      buckets.num_oversized++;
+      buckets.oversized_entries += list.size();
+    }
+  }
 }
 
 // Again all the hashes for point 1 come first, etc.
@@ -64,76 +94,579 @@ std::vector<uint64_t> Flinng::query(const std::vector<uint64_t> &hashes, uint32_
   uint64_t num_queries = hashes.size() / num_hash_tables;
   std::vector<uint64_t> results(top_k * num_queries);
 
-#pragma omp parallel for
-  for (uint32_t query_id = 0; query_id < num_queries; query_id++) {
+  flinng::parallel_for(thread_pool.get(), num_queries, [&](uint64_t query_id) {
+    query_one(hashes.data() + num_hash_tables * query_id, top_k,
+              results.data() + top_k * query_id);
+  });
+
+  return results;
+}
+
+std::vector<uint64_t> Flinng::query(const std::vector<uint64_t> &hashes, uint32_t top_k,
+                                    std::vector<uint32_t> &scores) {
 
-    std::vector<uint32_t> counts(num_rows * cells_per_row, 0);
-    for (uint32_t rep = 0; rep < num_hash_tables; rep++) {
-      const uint32_t index =
-          hash_range * rep + hashes[num_hash_tables * query_id + rep];
-      const uint32_t size = inverted_flinng_index[index].size();
-      for (uint32_t small_index = 0; small_index < size; small_index++) {
+  uint64_t num_queries = hashes.size() / num_hash_tables;
+  std::vector<uint64_t> results(top_k * num_queries);
+  scores.assign(top_k * num_queries, 0);
+
+  flinng::parallel_for(thread_pool.get(), num_queries, [&](uint64_t query_id) {
+    query_one(hashes.data() + num_hash_tables * query_id, top_k,
+              results.data() + top_k * query_id, scores.data() + top_k * query_id);
+  });
+
+  return results;
+}
+
+std::vector<uint64_t> Flinng::query(const std::vector<uint64_t> &hashes, uint32_t top_k,
+                                    flinng::QueryStats *stats, const flinng::QueryOptions *options) {
+
+  const uint64_t stride = num_hash_tables * probes_per_table(options);
+  uint64_t num_queries = hashes.size() / stride;
+  std::vector<uint64_t> results(top_k * num_queries);
+
+  flinng::parallel_for(thread_pool.get(), num_queries, [&](uint64_t query_id) {
+    query_one(hashes.data() + stride * query_id, top_k,
+              results.data() + top_k * query_id, nullptr, stats == nullptr ? nullptr : stats + query_id, options);
+  });
+
+  return results;
+}
+
+uint64_t Flinng::tables_to_probe(const flinng::QueryOptions *options) const {
+  if (options == nullptr || options->num_tables == 0) {
+    return num_hash_tables;
+  }
+  return std::min(options->num_tables, num_hash_tables);
+}
+
+uint64_t Flinng::probes_per_table(const flinng::QueryOptions *options) {
+  return options == nullptr || options->num_probes == 0 ? 1 : options->num_probes;
+}
+
+void Flinng::query_one(const uint64_t *hashes, uint32_t top_k, uint64_t *results,
+                       uint32_t *scores, flinng::QueryStats *stats,
+                       const flinng::QueryOptions *options) const {
+  rank(hashes, nullptr, top_k, results, scores, stats, options);
+}
+
+void Flinng::query_one_lazy(const TableHasher &hasher, uint32_t top_k, uint64_t *results,
+                            uint32_t *scores, flinng::QueryStats *stats,
+                            const flinng::QueryOptions *options) const {
+  rank(nullptr, &hasher, top_k, results, scores, stats, options);
+}
+
+// Either hashes holds every probed table or hasher computes them on demand
+void Flinng::rank(const uint64_t *hashes, const TableHasher *hasher, uint32_t top_k, uint64_t *results,
+                  uint32_t *scores, flinng::QueryStats *stats, const flinng::QueryOptions *options) const {
+
+#ifdef FLINNG_ENABLE_STATS
+  flinng::QueryStats local_stats;
+  if (stats == nullptr) {
+    stats = &local_stats;
+  }
+  auto phase_start = std::chrono::steady_clock::now();
+#endif
+
+  const uint64_t num_tables = tables_to_probe(options);
+  const bool early_stop = options != nullptr && options->early_stop_z > 0 && options->check_interval > 0;
+  const uint64_t leading_cells = options == nullptr || options->leading_cells == 0
+                                 ? num_rows * top_k : options->leading_cells;
+  const uint64_t num_probes = probes_per_table(options);
+  const uint32_t primary_weight = num_probes > 1 ? options->primary_weight : 1;
+  // Down-weighted lists count unscaled, every other list is scaled up
+  const uint32_t weight_scale = balance.policy == flinng::BucketPolicy::down_weight ? balance.down_weight : 1;
+  const uint32_t table_weight = (primary_weight + num_probes - 1) * weight_scale;
+  const bool balanced = balance.policy != flinng::BucketPolicy::none;
+
+  std::vector<uint64_t> lazy_hashes;
+  uint64_t tables_hashed = num_tables;
+  FLINNG_STATS(uint64_t lazy_hash_ns = 0);
+  if (hasher != nullptr) {
+    lazy_hashes.resize(num_tables * num_probes);
+    hashes = lazy_hashes.data();
+    tables_hashed = 0;
+  }
+
+  std::vector<uint32_t> counts(num_rows * cells_per_row, 0);
+  uint32_t tables_probed = 0;
+  while (tables_probed < num_tables) {
+    const uint32_t rep = tables_probed++;
+    if (rep == tables_hashed) {
+      // Tables are hashed one check interval ahead, or all at once without
+      // early termination
+      uint64_t block = early_stop ? std::min(options->check_interval, num_tables - rep) : num_tables - rep;
+      FLINNG_STATS(auto hash_start = std::chrono::steady_clock::now());
+      (*hasher)(rep, block, lazy_hashes.data() + rep * num_probes);
+      FLINNG_STATS(lazy_hash_ns += flinng::elapsed_ns(hash_start));
+      tables_hashed += block;
+    }
+    for (uint64_t probe = 0; probe < num_probes; probe++) {
+      const uint64_t hash = hashes[rep * num_probes + probe];
+      if (hash == no_probe) {
+        continue;
+      }
+      uint32_t weight = (probe == 0 ? primary_weight : 1) * weight_scale;
+      const uint32_t index = hash_range * rep + hash % hash_range;
+      const std::vector<uint32_t> *list = &inverted_flinng_index[index];
+      uint32_t stride = 1;
+      if (balanced && list->size() > buckets.threshold) {
+        apply_bucket_policy(index, hash, list, weight, stride);
+      }
+      const std::vector<uint32_t> &cells = *list;
+      const uint32_t size = cells.size();
+      FLINNG_STATS(stats->posting_entries_scanned += (size + stride - 1) / stride; index_stats->count_read(index));
+      for (uint32_t small_index = 0; small_index < size; small_index += stride) {
         // This single line takes 80% of the time, around half for the move
         // and half for the add
-        ++counts[inverted_flinng_index[index][small_index]];
+        counts[cells[small_index]] += weight;
       }
     }
+    if (early_stop && tables_probed % options->check_interval == 0 && tables_probed < num_tables &&
+        leading_cells_separated(counts, tables_probed * table_weight, num_tables - tables_probed, table_weight,
+                                leading_cells, options->early_stop_z)) {
+      break;
+    }
+  }
+  FLINNG_STATS(stats->tables_probed = tables_probed;
+               stats->count_ns = flinng::elapsed_ns(phase_start) - lazy_hash_ns;
+               if (hasher != nullptr) stats->hash_ns = lazy_hash_ns;
+               phase_start = std::chrono::steady_clock::now());
+
+  const uint32_t max_count = tables_probed * table_weight;
+  std::vector<uint32_t> sorted[max_count + 1];
+  uint32_t size_guess = num_rows * cells_per_row / (max_count + 1);
+  for (std::vector<uint32_t> &v: sorted) {
+    v.reserve(size_guess);
+  }
 
-    std::vector<uint32_t> sorted[num_hash_tables + 1];
-    uint32_t size_guess = num_rows * cells_per_row / (num_hash_tables + 1);
-    for (std::vector<uint32_t> &v: sorted) {
-      v.reserve(size_guess);
+  for (uint32_t i = 0; i < num_rows * cells_per_row; ++i) {
+    sorted[counts[i]].push_back(i);
+  }
+  FLINNG_STATS(stats->cells_hit = num_rows * cells_per_row - sorted[0].size();
+               stats->rank_ns = flinng::elapsed_ns(phase_start); phase_start = std::chrono::steady_clock::now());
+
+  resolve_candidates(sorted, max_count, top_k, results, scores, stats,
+                     options == nullptr ? nullptr : options->filter);
+  FLINNG_STATS(stats->resolve_ns = flinng::elapsed_ns(phase_start); index_stats->record(*stats));
+}
+
+void Flinng::apply_bucket_policy(uint64_t index, uint64_t hash, const std::vector<uint32_t> *&list,
+                                 uint32_t &weight, uint32_t &stride) const {
+  switch (balance.policy) {
+    case flinng::BucketPolicy::cap: {
+      uint64_t cap = std::max<uint64_t>(balance.cap_length == 0 ? buckets.threshold : balance.cap_length, 1);
+      stride = (list->size() + cap - 1) / cap;
+      break;
     }
+    case flinng::BucketPolicy::down_weight:
+      weight /= balance.down_weight;
+      break;
+    case flinng::BucketPolicy::split:
+      if (hash >= hash_range) {
+        auto split = split_lists.find(index);
+        if (split != split_lists.end()) {
+          list = &split->second[hash / hash_range - 1];
+        }
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Finds the counts of the leading_cells-th highest cell and of the next one.
+// No remaining table can raise a cell by more than table_weight, so the
+// leading cells are certain once their margin exceeds that many tables_left;
+// short of that the margin must exceed z standard deviations of a count over
+// tables_left tables.
+bool Flinng::leading_cells_separated(const std::vector<uint32_t> &counts, uint64_t max_count, uint64_t tables_left,
+                                     uint32_t table_weight, uint64_t leading_cells, double z) const {
+  std::vector<uint64_t> cells_per_count(max_count + 1, 0);
+  for (uint32_t count: counts) {
+    cells_per_count[count]++;
+  }
 
-    for (uint32_t i = 0; i < num_rows * cells_per_row; ++i) {
-      sorted[counts[i]].push_back(i);
+  int64_t lead_count = -1, next_count = -1;
+  uint64_t seen = 0;
+  for (int64_t count = max_count; count >= 0 && next_count < 0; count--) {
+    if (cells_per_count[count] == 0) {
+      continue;
+    }
+    if (lead_count >= 0) {
+      next_count = count;
+    } else if (seen + cells_per_count[count] >= leading_cells) {
+      lead_count = count;
+      if (seen + cells_per_count[count] > leading_cells) {
+        // The boundary falls between cells of equal counts
+        return false;
+      }
     }
+    seen += cells_per_count[count];
+  }
+  if (lead_count < 0 || next_count < 0) {
+    return false;
+  }
+
+  double bound = table_weight * std::min(static_cast<double>(tables_left),
+                                         z * std::sqrt(static_cast<double>(tables_left)));
+  return lead_count - next_count > bound;
+}
 
-    if (num_rows > 2) {
-      std::vector<uint8_t> num_counts(total_points_added, 0);
-      uint32_t num_found = 0;
-      for (int32_t rep = num_hash_tables; rep >= 0; --rep) {
-        for (uint32_t bin: sorted[rep]) {
-          for (uint32_t point: cell_membership[bin]) {
-            if (++num_counts[point] == num_rows) {
-              results[top_k * query_id + num_found] = point;
-              if (++num_found == top_k) {
-                goto end_of_query;
-              }
+// Walks the cells from the highest count down and returns the first top_k
+// points seen in num_rows of them. Filtered out points are only checked once
+// they are complete, so the filter costs one label lookup per candidate.
+void Flinng::resolve_candidates(const std::vector<uint32_t> *sorted, uint32_t max_count, uint32_t top_k,
+                                uint64_t *results, uint32_t *scores, flinng::QueryStats *stats,
+                                const flinng::LabelFilter *filter) const {
+  uint32_t num_found = 0;
+  if (num_rows > 2) {
+    std::vector<uint8_t> num_counts(total_points_added, 0);
+    for (int32_t rep = max_count; rep >= 0; --rep) {
+      for (uint32_t bin: sorted[rep]) {
+        FLINNG_STATS(stats->cells_visited++; stats->candidates_resolved += cell_membership[bin].size());
+        for (uint32_t point: cell_membership[bin]) {
+          if (++num_counts[point] == num_rows && accepts(filter, point)) {
+            results[num_found] = point;
+            if (scores != nullptr) {
+              scores[num_found] = rep;
+            }
+            if (++num_found == top_k) {
+              FLINNG_STATS(stats->final_score = rep);
+              return;
             }
           }
         }
       }
-    } else {
-      char *num_counts =
-          (char *) calloc(total_points_added / 8 + 1, sizeof(char));
-      uint32_t num_found = 0;
-      for (int32_t rep = num_hash_tables; rep >= 0; --rep) {
-        for (uint32_t bin: sorted[rep]) {
-          for (uint32_t point: cell_membership[bin]) {
-            if (num_counts[(point / 8)] & (1 << (point % 8))) {
-              results[top_k * query_id + num_found] = point;
-              if (++num_found == top_k) {
-                free(num_counts);
-                goto end_of_query;
-              }
-            } else {
-              num_counts[(point / 8)] |= (1 << (point % 8));
+    }
+  } else {
+    std::vector<char> num_counts(total_points_added / 8 + 1, 0);
+    for (int32_t rep = max_count; rep >= 0; --rep) {
+      for (uint32_t bin: sorted[rep]) {
+        FLINNG_STATS(stats->cells_visited++; stats->candidates_resolved += cell_membership[bin].size());
+        for (uint32_t point: cell_membership[bin]) {
+          if (num_counts[(point / 8)] & (1 << (point % 8))) {
+            if (!accepts(filter, point)) {
+              continue;
+            }
+            results[num_found] = point;
+            if (scores != nullptr) {
+              scores[num_found] = rep;
+            }
+            if (++num_found == top_k) {
+              FLINNG_STATS(stats->final_score = rep);
+              return;
             }
+          } else {
+            num_counts[(point / 8)] |= (1 << (point % 8));
           }
         }
       }
     }
-    end_of_query:;
   }
-
-  return results;
+  std::fill(results + num_found, results + top_k, UINT64_MAX);
 }
 
 uint64_t Flinng::num_points_added() const {
   return total_points_added;
 }
 
+void Flinng::set_labels(uint64_t first_point, const uint32_t *point_labels, uint64_t num_points) {
+  if (first_point + num_points > total_points_added) {
+    throw std::invalid_argument("Only points that have been added can be labeled.");
+  }
+  labels.resize(total_points_added, 0);
+  std::copy(point_labels, point_labels + num_points, labels.begin() + first_point);
+}
+
+uint32_t Flinng::label(uint64_t point) const {
+  return labels.empty() ? 0 : labels[point];
+}
+
+bool Flinng::has_labels() const {
+  return !labels.empty();
+}
+
+void Flinng::store_signatures(bool store) {
+  if (store && !keep_signatures && total_points_added > 0) {
+    throw std::invalid_argument("The signatures of points already added are lost, "
+                                "they must be stored before adding points.");
+  }
+  if (store && hash_range - 1 > UINT32_MAX) {
+    throw std::invalid_argument("Signatures are stored as 32 bit hashes.");
+  }
+  keep_signatures = store;
+  if (!store) {
+    std::vector<uint32_t>().swap(signatures);
+  }
+}
+
+bool Flinng::stores_signatures() const {
+  return keep_signatures;
+}
+
+void Flinng::regroup(uint64_t new_num_rows, uint64_t new_cells_per_row) {
+  if (!keep_signatures || signatures.size() != total_points_added * num_hash_tables) {
+    throw std::invalid_argument("Regrouping needs the signatures of every point, see store_signatures.");
+  }
+  if (new_num_rows == 0 || new_cells_per_row == 0) {
+    throw std::invalid_argument("There must be at least 1 row and 1 cell per row.");
+  }
+  num_rows = new_num_rows;
+  cells_per_row = new_cells_per_row;
+  split_lists.clear();
+
+  // Same cell assignment as addPoints
+  std::vector<uint64_t> random_buckets(num_rows * total_points_added);
+  for (uint64_t i = 0; i < num_rows * total_points_added; i++) {
+    random_buckets[i] =
+        (rand() % cells_per_row + cells_per_row) % cells_per_row +
+        (i % num_rows) * cells_per_row;
+  }
+
+  // Every table owns its posting lists and every row its cells
+  inverted_flinng_index.assign(hash_range * num_hash_tables, std::vector<uint32_t>());
+  flinng::parallel_for(thread_pool.get(), num_hash_tables, [&](uint64_t table) {
+    for (uint64_t point = 0; point < total_points_added; point++) {
+      uint64_t hash_id = table * hash_range + signatures[point * num_hash_tables + table];
+      for (uint64_t row = 0; row < num_rows; row++) {
+        inverted_flinng_index[hash_id].push_back(random_buckets[point * num_rows + row]);
+      }
+    }
+    for (uint64_t hash_id = table * hash_range; hash_id < (table + 1) * hash_range; hash_id++) {
+      std::vector<uint32_t> &list = inverted_flinng_index[hash_id];
+      std::sort(list.begin(), list.end());
+      list.erase(std::unique(list.begin(), list.end()), list.end());
+    }
+  });
+
+  cell_membership.assign(num_rows * cells_per_row, std::vector<uint64_t>());
+  flinng::parallel_for(thread_pool.get(), num_rows, [&](uint64_t row) {
+    for (uint64_t point = 0; point < total_points_added; point++) {
+      cell_membership[random_buckets[point * num_rows + row]].push_back(point);
+    }
+  });
+
+  update_bucket_stats();
+}
+
+void Flinng::set_bucket_balance(const flinng::BucketBalance &new_balance) {
+  if (new_balance.policy == flinng::BucketPolicy::down_weight && new_balance.down_weight == 0) {
+    throw std::invalid_argument("down_weight must be positive.");
+  }
+  if (new_balance.policy == flinng::BucketPolicy::split &&
+      (new_balance.split_bits == 0 || new_balance.split_bits > 16)) {
+    throw std::invalid_argument("split_bits must be between 1 and 16.");
+  }
+  balance = new_balance;
+  split_lists.clear();
+  update_bucket_stats();
+}
+
+const flinng::BucketBalance &Flinng::bucket_balance() const {
+  return balance;
+}
+
+const flinng::BucketStats &Flinng::bucket_stats() const {
+  return buckets;
+}
+
+void Flinng::split_oversized_buckets(const PointHasher &hasher) {
+  if (balance.policy != flinng::BucketPolicy::split) {
+    throw std::invalid_argument("Buckets can only be split with the split policy.");
+  }
+
+  split_lists.clear();
+  for (uint64_t i = 0; i < inverted_flinng_index.size(); i++) {
+    if (inverted_flinng_index[i].size() > buckets.threshold) {
+      split_lists[i].resize(uint64_t(1) << balance.split_bits);
+    }
+  }
+  if (split_lists.empty()) {
+    return;
+  }
+
+  // The cells of every point, by row
+  std::vector<uint32_t> point_cells(total_points_added * num_rows);
+  for (uint64_t cell = 0; cell < cell_membership.size(); cell++) {
+    for (uint64_t point: cell_membership[cell]) {
+      point_cells[point * num_rows + cell / cells_per_row] = cell;
+    }
+  }
+
+  const uint64_t chunk_size = 1 << 14;
+  std::vector<uint64_t> hashes;
+  for (uint64_t first = 0; first < total_points_added; first += chunk_size) {
+    uint64_t num_points = std::min(chunk_size, total_points_added - first);
+    hashes.resize(num_points * num_hash_tables);
+    hasher(first, num_points, hashes.data());
+    // Every table owns distinct lists
+    flinng::parallel_for(thread_pool.get(), num_hash_tables, [&](uint64_t table) {
+      for (uint64_t point = 0; point < num_points; point++) {
+        uint64_t hash = hashes[point * num_hash_tables + table];
+        auto split = split_lists.find(table * hash_range + hash % hash_range);
+        if (split == split_lists.end() || hash < hash_range) {
+          continue;
+        }
+        std::vector<uint32_t> &list = split->second[hash / hash_range - 1];
+        for (uint64_t row = 0; row < num_rows; row++) {
+          list.push_back(point_cells[(first + point) * num_rows + row]);
+        }
+      }
+    });
+  }
+
+  for (auto &split: split_lists) {
+    for (std::vector<uint32_t> &list: split.second) {
+      std::sort(list.begin(), list.end());
+      list.erase(std::unique(list.begin(), list.end()), list.end());
+    }
+  }
+}
+
+bool Flinng::is_split(uint64_t table, uint64_t hash) const {
+  return split_lists.count(table * hash_range + hash % hash_range) > 0;
+}
+
+bool Flinng::has_split_buckets() const {
+  return !split_lists.empty();
+}
+
+flinng::LabelFilter flinng::LabelFilter::allow(const std::vector<uint32_t> &labels) {
+  LabelFilter filter;
+  for (uint32_t label: labels) {
+    if (label / 64 >= filter.allowed.size()) {
+      filter.allowed.resize(label / 64 + 1, 0);
+    }
+    filter.allowed[label / 64] |= uint64_t(1) << (label % 64);
+  }
+  return filter;
+}
+
+flinng::LabelFilter flinng::LabelFilter::matching(std::function<bool(uint32_t)> predicate) {
+  LabelFilter filter;
+  filter.predicate = std::move(predicate);
+  return filter;
+}
+
+void Flinng::merge(const Flinng &other) {
+  if (num_rows != other.num_rows || cells_per_row != other.cells_per_row ||
+      num_hash_tables != other.num_hash_tables || hash_range != other.hash_range) {
+    throw std::invalid_argument("Only indexes with identical num_rows, cells_per_row, "
+                                "num_hash_tables and hash_range can be merged.");
+  }
+  if (keep_signatures != other.keep_signatures) {
+    throw std::invalid_argument("Either both or neither of the merged indexes must store signatures.");
+  }
+
+  if (this == &other) {
+    throw std::invalid_argument("An index cannot be merged into itself, merge a copy of it instead.");
+  }
+
+  const uint64_t offset = total_points_added;
+  split_lists.clear();
+
+  // Cell ids are the same in both indexes, so posting lists are unioned as is
+  // and only the point ids in the cells need to be remapped
+  flinng::parallel_for(thread_pool.get(), inverted_flinng_index.size(), [&](uint64_t i) {
+    const std::vector<uint32_t> &theirs = other.inverted_flinng_index[i];
+    if (theirs.empty()) {
+      return;
+    }
+    std::vector<uint32_t> merged;
+    merged.reserve(inverted_flinng_index[i].size() + theirs.size());
+    std::set_union(inverted_flinng_index[i].begin(), inverted_flinng_index[i].end(),
+                   theirs.begin(), theirs.end(), std::back_inserter(merged));
+    inverted_flinng_index[i].swap(merged);
+  });
+
+  flinng::parallel_for(thread_pool.get(), cell_membership.size(), [&](uint64_t i) {
+    for (uint64_t point: other.cell_membership[i]) {
+      cell_membership[i].push_back(point + offset);
+    }
+  });
+
+  if (!labels.empty() || !other.labels.empty()) {
+    labels.resize(offset, 0);
+    if (other.labels.empty()) {
+      labels.resize(offset + other.total_points_added, 0);
+    } else {
+      labels.insert(labels.end(), other.labels.begin(), other.labels.end());
+    }
+  }
+
+  signatures.insert(signatures.end(), other.signatures.begin(), other.signatures.end());
+
+  total_points_added += other.total_points_added;
+  update_bucket_stats();
+}
+
+void Flinng::set_thread_pool(std::shared_ptr<flinng::ThreadPool> pool) {
+  thread_pool = pool;
+}
+
+flinng::MemoryReport Flinng::memory_report() const {
+  flinng::MemoryReport report;
+  report.posting_lists = flinng::vector_memory(inverted_flinng_index);
+  for (const auto &split: split_lists) {
+    report.posting_lists += flinng::vector_memory(split.second);
+    report.posting_lists.overhead += sizeof(split);
+  }
+  report.cell_membership = flinng::vector_memory(cell_membership);
+  report.labels = flinng::vector_memory(labels);
+  report.signatures = flinng::vector_memory(signatures);
+  if (index_stats) {
+    uint64_t bytes = inverted_flinng_index.size() * sizeof(std::atomic<uint32_t>);
+    report.stats.used = bytes;
+    report.stats.reserved = bytes;
+    report.stats.overhead = sizeof(flinng::IndexStats);
+  }
+  return report;
+}
+
+void Flinng::compact() {
+  flinng::parallel_for(thread_pool.get(), inverted_flinng_index.size(), [&](uint64_t i) {
+    flinng::shrink_vector(inverted_flinng_index[i]);
+  });
+  flinng::parallel_for(thread_pool.get(), cell_membership.size(), [&](uint64_t i) {
+    flinng::shrink_vector(cell_membership[i]);
+  });
+  flinng::shrink_vector(labels);
+  flinng::shrink_vector(signatures);
+  for (auto &split: split_lists) {
+    for (std::vector<uint32_t> &list: split.second) {
+      flinng::shrink_vector(list);
+    }
+  }
+}
+
+const flinng::IndexStats *Flinng::query_stats() const {
+  return index_stats.get();
+}
+
+void Flinng::reset_query_stats() {
+  if (index_stats) {
+    index_stats->reset();
+  }
+}
+
+std::vector<flinng::HotBucket> Flinng::hot_buckets(uint64_t count) const {
+  std::vector<flinng::HotBucket> buckets;
+  buckets.reserve(inverted_flinng_index.size());
+  for (uint64_t i = 0; i < inverted_flinng_index.size(); i++) {
+    uint64_t length = inverted_flinng_index[i].size();
+    uint64_t reads = index_stats ? index_stats->posting_list_reads(i) : 0;
+    buckets.push_back({i / hash_range, i % hash_range, length, reads, length * reads});
+  }
+  count = std::min<uint64_t>(count, buckets.size());
+  std::partial_sort(buckets.begin(), buckets.begin() + count, buckets.end(),
+                    [](const flinng::HotBucket &a, const flinng::HotBucket &b) {
+                      return a.entries_scanned != b.entries_scanned ? a.entries_scanned > b.entries_scanned
+                                                                    : a.length > b.length;
+                    });
+  buckets.resize(count);
+  return buckets;
+}
+
 void Flinng::write_content_to_index(flinng::FileIO &index) {
   flinng::write_verify(&num_rows, sizeof(num_rows), 1, index);
   flinng::write_verify(&cells_per_row, sizeof(cells_per_row), 1, index);
@@ -164,6 +697,7 @@ void Flinng::read_content_from_index(flinng::FileIO &index) {
   flinng::read_verify(&num_hash_tables, sizeof(num_hash_tables), 1, index);
   flinng::read_verify(&hash_range, sizeof(hash_range), 1, index);
   flinng::read_verify(&total_points_added, sizeof(total_points_added), 1, index);
+  FLINNG_STATS(index_stats.reset(new flinng::IndexStats(hash_range * num_hash_tables)));
 
   size_t tmp;
   flinng::read_verify(&tmp, sizeof(size_t), 1, index);
@@ -183,4 +717,91 @@ void Flinng::read_content_from_index(flinng::FileIO &index) {
     cell_membership[i].resize(tmp2);
     flinng::read_verify(cell_membership[i].data(), sizeof(uint64_t), tmp2, index);
   }
-}
\ No newline at end of file
+  // Derived from the lists, so streamed and older indexes load with them too
+  update_bucket_stats();
+}
+
+void Flinng::write_sections_to_index(flinng::FileIO &index) {
+  if (!labels.empty()) {
+    flinng::write_section_header(index, flinng::LABELS_SECTION, labels.size() * sizeof(uint32_t));
+    flinng::write_verify(labels.data(), sizeof(uint32_t), labels.size(), index);
+  }
+
+  if (keep_signatures) {
+    flinng::write_section_header(index, flinng::SIGNATURES_SECTION, signatures.size() * sizeof(uint32_t));
+    flinng::write_verify(signatures.data(), sizeof(uint32_t), signatures.size(), index);
+  }
+
+  if (balance.policy != flinng::BucketPolicy::none) {
+    // Policy, then every split list as its index followed by its 2^split_bits
+    // size-prefixed lists
+    uint64_t size = sizeof(uint32_t) + sizeof(double) + 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t) +
+                    sizeof(uint64_t);
+    for (const auto &split: split_lists) {
+      size += sizeof(uint64_t);
+      for (const std::vector<uint32_t> &list: split.second) {
+        size += sizeof(uint64_t) + list.size() * sizeof(uint32_t);
+      }
+    }
+    flinng::write_section_header(index, flinng::BUCKET_BALANCE_SECTION, size);
+    flinng::write_verify(&balance.policy, sizeof(uint32_t), 1, index);
+    flinng::write_verify(&balance.oversize_factor, sizeof(double), 1, index);
+    flinng::write_verify(&balance.min_length, sizeof(uint64_t), 1, index);
+    flinng::write_verify(&balance.cap_length, sizeof(uint64_t), 1, index);
+    flinng::write_verify(&balance.down_weight, sizeof(uint32_t), 1, index);
+    flinng::write_verify(&balance.split_bits, sizeof(uint32_t), 1, index);
+    uint64_t tmp = split_lists.size();
+    flinng::write_verify(&tmp, sizeof(uint64_t), 1, index);
+    for (auto &split: split_lists) {
+      tmp = split.first;
+      flinng::write_verify(&tmp, sizeof(uint64_t), 1, index);
+      for (std::vector<uint32_t> &list: split.second) {
+        tmp = list.size();
+        flinng::write_verify(&tmp, sizeof(uint64_t), 1, index);
+        flinng::write_verify(list.data(), sizeof(uint32_t), list.size(), index);
+      }
+    }
+  }
+}
+
+bool Flinng::read_section_from_index(flinng::FileIO &index, uint32_t tag, uint64_t size) {
+  switch (tag) {
+    case flinng::LABELS_SECTION:
+      labels.resize(size / sizeof(uint32_t));
+      flinng::read_verify(labels.data(), sizeof(uint32_t), labels.size(), index);
+      return true;
+    case flinng::SIGNATURES_SECTION:
+      keep_signatures = true;
+      signatures.resize(size / sizeof(uint32_t));
+      flinng::read_verify(signatures.data(), sizeof(uint32_t), signatures.size(), index);
+      return true;
+    case flinng::BUCKET_BALANCE_SECTION: {
+      flinng::read_verify(&balance.policy, sizeof(uint32_t), 1, index);
+      flinng::read_verify(&balance.oversize_factor, sizeof(double), 1, index);
+      flinng::read_verify(&balance.min_length, sizeof(uint64_t), 1, index);
+      flinng::read_verify(&balance.cap_length, sizeof(uint64_t), 1, index);
+      flinng::read_verify(&balance.down_weight, sizeof(uint32_t), 1, index);
+      flinng::read_verify(&balance.split_bits, sizeof(uint32_t), 1, index);
+      uint64_t num_splits;
+      flinng::read_verify(&num_splits, sizeof(uint64_t), 1, index);
+      split_lists.clear();
+      for (uint64_t i = 0; i < num_splits; i++) {
+        uint64_t list_index;
+        flinng::read_verify(&list_index, sizeof(uint64_t), 1, index);
+        std::vector<std::vector<uint32_t>> &split = split_lists[list_index];
+        split.resize(uint64_t(1) << balance.split_bits);
+        for (std::vector<uint32_t> &list: split) {
+          uint64_t length;
+          flinng::read_verify(&length, sizeof(uint64_t), 1, index);
+          list.resize(length);
+          flinng::read_verify(list.data(), sizeof(uint32_t), length, index);
+        }
+      }
+      // The oversize threshold depends on the policy
+      update_bucket_stats();
+      return true;
+    }
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,203 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "FlinngClient.h"
+
+namespace flinng {
+
+  FlinngClient::FlinngClient(const char *socket_path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+      error = "Socket path is too long";
+      return;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+      error = std::string("Error while connecting to ") + socket_path + ": " + strerror(errno);
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  FlinngClient::~FlinngClient() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool FlinngClient::connected() const {
+    return fd >= 0;
+  }
+
+  const std::string &FlinngClient::last_error() const {
+    return error;
+  }
+
+  protocol::Writer FlinngClient::header(uint8_t opcode, uint32_t request_id, uint32_t index_id) {
+    protocol::Writer request;
+    request.put(opcode);
+    request.put(request_id);
+    request.put(index_id);
+    return request;
+  }
+
+  uint32_t FlinngClient::send_request(protocol::Writer &request, uint32_t request_id) {
+    if (fd < 0 || !protocol::send_frame(fd, request.data())) {
+      error = "Error while sending request";
+      return 0;
+    }
+    return request_id;
+  }
+
+  uint32_t FlinngClient::send_info(uint32_t index_id) {
+    uint32_t request_id = next_request_id++;
+    protocol::Writer request = header(protocol::INFO, request_id, index_id);
+    return send_request(request, request_id);
+  }
+
+  uint32_t FlinngClient::send_add(uint32_t index_id, const float *points, uint32_t num_points, uint64_t dimension) {
+    uint32_t request_id = next_request_id++;
+    protocol::Writer request = header(protocol::ADD, request_id, index_id);
+    request.put(num_points);
+    request.put_array(points, num_points * dimension);
+    return send_request(request, request_id);
+  }
+
+  uint32_t FlinngClient::send_search(uint32_t index_id, const float *queries, uint32_t num_queries,
+                                     uint64_t dimension, uint32_t top_k, bool with_distance) {
+    uint32_t request_id = next_request_id++;
+    protocol::Writer request = header(with_distance ? protocol::SEARCH_WITH_DISTANCE : protocol::SEARCH,
+                                      request_id, index_id);
+    request.put(num_queries);
+    request.put(top_k);
+    request.put_array(queries, num_queries * dimension);
+    return send_request(request, request_id);
+  }
+
+  bool FlinngClient::read_response(Response &response) {
+    std::vector<uint8_t> payload;
+    if (fd < 0 || !protocol::recv_frame(fd, payload)) {
+      error = "Error while receiving response";
+      return false;
+    }
+
+    protocol::Reader reader(payload);
+    response = Response();
+    bool ok = reader.get(response.status) && reader.get(response.opcode) && reader.get(response.request_id);
+    if (ok && response.status != protocol::OK) {
+      uint32_t length = 0;
+      ok = reader.get(length) && length <= reader.remaining();
+      response.error.resize(length);
+      ok = ok && reader.get_array(&response.error[0], length);
+    } else if (ok && response.opcode == protocol::INFO) {
+      uint8_t stores = 0;
+      ok = reader.get(response.dimension) && reader.get(response.num_points) && reader.get(stores);
+      response.stores_dataset = stores != 0;
+    } else if (ok && response.opcode == protocol::ADD) {
+      ok = reader.get(response.num_points);
+    } else if (ok) {
+      ok = reader.get(response.num_queries) && reader.get(response.top_k);
+      uint64_t count = static_cast<uint64_t>(response.num_queries) * response.top_k;
+      ok = ok && count * sizeof(int64_t) <= reader.remaining();
+      if (ok) {
+        response.ids.resize(count);
+        ok = reader.get_array(response.ids.data(), count);
+        if (ok && response.opcode == protocol::SEARCH_WITH_DISTANCE) {
+          response.distances.resize(count);
+          ok = reader.get_array(response.distances.data(), count);
+        }
+      }
+    }
+
+    if (!ok) {
+      error = "Malformed response";
+    }
+    return ok;
+  }
+
+  bool FlinngClient::receive(Response &response, uint32_t request_id) {
+    if (request_id == 0 && !early_responses.empty()) {
+      response = std::move(early_responses.begin()->second);
+      early_responses.erase(early_responses.begin());
+      return true;
+    }
+    auto early = early_responses.find(request_id);
+    if (early != early_responses.end()) {
+      response = std::move(early->second);
+      early_responses.erase(early);
+      return true;
+    }
+
+    while (read_response(response)) {
+      if (request_id == 0 || response.request_id == request_id) {
+        return true;
+      }
+      early_responses[response.request_id] = std::move(response);
+    }
+    return false;
+  }
+
+  uint64_t FlinngClient::dimension_of(uint32_t index_id) {
+    auto cached = dimensions.find(index_id);
+    if (cached != dimensions.end()) {
+      return cached->second;
+    }
+    uint64_t dimension, num_points;
+    return info(index_id, dimension, num_points) ? dimension : 0;
+  }
+
+  bool FlinngClient::info(uint32_t index_id, uint64_t &dimension, uint64_t &num_points) {
+    Response response;
+    uint32_t request_id = send_info(index_id);
+    if (request_id == 0 || !receive(response, request_id)) {
+      return false;
+    }
+    if (response.status != protocol::OK) {
+      error = response.error;
+      return false;
+    }
+    dimension = response.dimension;
+    num_points = response.num_points;
+    dimensions[index_id] = dimension;
+    return true;
+  }
+
+  uint64_t FlinngClient::add(uint32_t index_id, const float *points, uint32_t num_points) {
+    uint64_t dimension = dimension_of(index_id);
+    Response response;
+    uint32_t request_id = dimension == 0 ? 0 : send_add(index_id, points, num_points, dimension);
+    if (request_id == 0 || !receive(response, request_id)) {
+      return 0;
+    }
+    if (response.status != protocol::OK) {
+      error = response.error;
+      return 0;
+    }
+    return response.num_points;
+  }
+
+  bool FlinngClient::search(uint32_t index_id, const float *queries, uint32_t num_queries, uint32_t top_k,
+                            long *ids, float *distances) {
+    uint64_t dimension = dimension_of(index_id);
+    Response response;
+    uint32_t request_id = dimension == 0 ? 0 : send_search(index_id, queries, num_queries, dimension, top_k,
+                                                           distances != nullptr);
+    if (request_id == 0 || !receive(response, request_id)) {
+      return false;
+    }
+    if (response.status != protocol::OK) {
+      error = response.error;
+      return false;
+    }
+    std::copy(response.ids.begin(), response.ids.end(), ids);
+    if (distances != nullptr) {
+      std::copy(response.distances.begin(), response.distances.end(), distances);
+    }
+    return true;
+  }
+
+} //end namespace flinng
@@ -0,0 +1,56 @@
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "FlinngProtocol.h"
+
+namespace flinng {
+  namespace protocol {
+
+    static bool write_full(int fd, const void *data, uint64_t size) {
+      const uint8_t *bytes = static_cast<const uint8_t *>(data);
+      while (size > 0) {
+        ssize_t ret = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if (ret <= 0) {
+          return false;
+        }
+        bytes += ret;
+        size -= ret;
+      }
+      return true;
+    }
+
+    static bool read_full(int fd, void *data, uint64_t size) {
+      uint8_t *bytes = static_cast<uint8_t *>(data);
+      while (size > 0) {
+        ssize_t ret = recv(fd, bytes, size, 0);
+        if (ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if (ret <= 0) {
+          return false;
+        }
+        bytes += ret;
+        size -= ret;
+      }
+      return true;
+    }
+
+    bool send_frame(int fd, const std::vector<uint8_t> &payload) {
+      uint32_t size = payload.size();
+      return write_full(fd, &size, sizeof(size)) && write_full(fd, payload.data(), size);
+    }
+
+    bool recv_frame(int fd, std::vector<uint8_t> &payload) {
+      uint32_t size;
+      if (!read_full(fd, &size, sizeof(size)) || size > max_frame_size) {
+        return false;
+      }
+      payload.resize(size);
+      return read_full(fd, payload.data(), size);
+    }
+
+  } //end namespace protocol
+} //end namespace flinng
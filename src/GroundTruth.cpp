@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+#include "GroundTruth.h"
+
+namespace flinng {
+
+  // Keeps the k smallest (distance, id) pairs seen so far
+  static void select_k(std::vector<std::pair<float, uint64_t>> &candidates, uint32_t k, uint64_t *result) {
+    uint64_t keep = std::min<uint64_t>(k, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end());
+    for (uint64_t i = 0; i < k; i++) {
+      result[i] = i < keep ? candidates[i].second : UINT64_MAX;
+    }
+  }
+
+  std::vector<uint64_t> brute_force_knn(const float *data, uint64_t num_points, const float *queries,
+                                        uint64_t num_queries, uint64_t dimension, uint32_t k, bool l2) {
+    std::vector<float> norms(l2 ? 0 : num_points);
+#pragma omp parallel for
+    for (uint64_t i = 0; i < norms.size(); i++) {
+      float accu = 0;
+      for (uint64_t j = 0; j < dimension; j++) {
+        accu += data[i * dimension + j] * data[i * dimension + j];
+      }
+      norms[i] = sqrtf(accu);
+    }
+
+    std::vector<uint64_t> results(num_queries * k);
+#pragma omp parallel for schedule(dynamic)
+    for (uint64_t q = 0; q < num_queries; q++) {
+      const float *query = queries + q * dimension;
+      std::vector<std::pair<float, uint64_t>> candidates(num_points);
+      for (uint64_t i = 0; i < num_points; i++) {
+        const float *point = data + i * dimension;
+        float accu = 0;
+        if (l2) {
+          for (uint64_t j = 0; j < dimension; j++) {
+            float diff = query[j] - point[j];
+            accu += diff * diff;
+          }
+        } else {
+          // The query norm does not change the ranking
+          for (uint64_t j = 0; j < dimension; j++) {
+            accu += query[j] * point[j];
+          }
+          accu = norms[i] > 0 ? -accu / norms[i] : 0;
+        }
+        candidates[i] = std::make_pair(accu, i);
+      }
+      select_k(candidates, k, results.data() + q * k);
+    }
+    return results;
+  }
+
+  std::vector<uint64_t> brute_force_knn(const std::vector<std::vector<uint64_t>> &data,
+                                        const std::vector<std::vector<uint64_t>> &queries, uint32_t k) {
+    std::vector<std::vector<uint64_t>> sorted_data(data);
+#pragma omp parallel for
+    for (uint64_t i = 0; i < sorted_data.size(); i++) {
+      std::sort(sorted_data[i].begin(), sorted_data[i].end());
+      sorted_data[i].erase(std::unique(sorted_data[i].begin(), sorted_data[i].end()), sorted_data[i].end());
+    }
+
+    std::vector<uint64_t> results(queries.size() * k);
+#pragma omp parallel for schedule(dynamic)
+    for (uint64_t q = 0; q < queries.size(); q++) {
+      std::vector<uint64_t> query(queries[q]);
+      std::sort(query.begin(), query.end());
+      query.erase(std::unique(query.begin(), query.end()), query.end());
+
+      std::vector<std::pair<float, uint64_t>> candidates(sorted_data.size());
+      for (uint64_t i = 0; i < sorted_data.size(); i++) {
+        const std::vector<uint64_t> &point = sorted_data[i];
+        uint64_t shared = 0;
+        auto a = query.begin();
+        auto b = point.begin();
+        while (a != query.end() && b != point.end()) {
+          if (*a < *b) {
+            ++a;
+          } else if (*b < *a) {
+            ++b;
+          } else {
+            ++shared, ++a, ++b;
+          }
+        }
+        uint64_t total = query.size() + point.size() - shared;
+        candidates[i] = std::make_pair(total == 0 ? 0.0f : -static_cast<float>(shared) / total, i);
+      }
+      select_k(candidates, k, results.data() + q * k);
+    }
+    return results;
+  }
+
+  double recall_at_k(const std::vector<uint64_t> &results, uint64_t result_stride,
+                     const std::vector<uint64_t> &ground_truth, uint64_t gt_stride,
+                     uint64_t num_queries, uint32_t k, uint32_t gt_k) {
+    if (num_queries == 0 || gt_k == 0) {
+      return 0;
+    }
+    uint64_t found = 0;
+    for (uint64_t q = 0; q < num_queries; q++) {
+      std::unordered_set<uint64_t> truth(ground_truth.begin() + q * gt_stride,
+                                         ground_truth.begin() + q * gt_stride + gt_k);
+      for (uint64_t i = 0; i < k; i++) {
+        found += truth.count(results[q * result_stride + i]);
+      }
+    }
+    return static_cast<double>(found) / (num_queries * gt_k);
+  }
+
+} //end namespace flinng
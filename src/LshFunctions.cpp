@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <climits>
 #include <cmath>
+#include <limits>
 #include <cstdint>
 #include <iostream>
 #include <vector>
@@ -103,34 +105,134 @@ parallel_densified_minhash(const std::vector<std::vector<uint64_t>> &points,
   return result;
 }
 
+// Margin of a bit that has no neighboring bucket
+static const double no_margin = std::numeric_limits<double>::max();
+
+// Fills order with the indices of the count lowest margins, lowest first
+static void least_confident(const std::vector<double> &margins, uint64_t count,
+                            std::vector<uint64_t> &order) {
+  order.clear();
+  for (uint64_t i = 0; i < margins.size(); i++) {
+    if (margins[i] < no_margin) {
+      order.push_back(i);
+    }
+  }
+  count = std::min<uint64_t>(count, order.size());
+  std::partial_sort(order.begin(), order.begin() + count, order.end(),
+                    [&](uint64_t a, uint64_t b) { return margins[a] < margins[b]; });
+  order.resize(count);
+}
+
+void single_srp(uint64_t *result, const float *point, uint64_t data_dimension,
+                const int8_t *random_bits, uint64_t num_tables,
+                uint64_t hashes_per_table, uint64_t num_probes) {
+  std::vector<double> margins(num_probes > 1 ? hashes_per_table : 0);
+  std::vector<uint64_t> order;
+  for (uint64_t rep = 0; rep < num_tables; rep++) {
+    uint64_t hash = 0;
+    for (uint64_t bit = 0; bit < hashes_per_table; bit++) {
+      double sum = 0;
+      for (uint64_t j = 0; j < data_dimension; j++) {
+        double val = point[j];
+        if (random_bits[rep * hashes_per_table * data_dimension +
+                        bit * data_dimension + j] > 0) {
+          sum += val;
+        } else {
+          sum -= val;
+        }
+      }
+      hash += (sum > 0) << bit;
+      if (num_probes > 1) {
+        margins[bit] = std::fabs(sum);
+      }
+    }
+    uint64_t *probes = result + rep * num_probes;
+    probes[0] = hash;
+    if (num_probes > 1) {
+      least_confident(margins, num_probes - 1, order);
+      for (uint64_t p = 1; p < num_probes; p++) {
+        probes[p] = p <= order.size() ? hash ^ (1ull << order[p - 1]) : no_probe;
+      }
+    }
+  }
+}
+
 std::vector<uint64_t> parallel_srp(const float *dense_data, uint64_t num_points,
                                    uint64_t data_dimension, int8_t *random_bits,
                                    uint64_t num_tables,
-                                   uint64_t hashes_per_table) {
-  std::vector<uint64_t> result(num_tables * num_points);
+                                   uint64_t hashes_per_table,
+                                   uint64_t num_probes) {
+  std::vector<uint64_t> result(num_tables * num_probes * num_points);
 
 #pragma omp parallel for
   for (uint64_t data_id = 0; data_id < num_points; data_id++) {
-    for (uint64_t rep = 0; rep < num_tables; rep++) {
-      uint64_t hash = 0;
-      for (uint64_t bit = 0; bit < hashes_per_table; bit++) {
-        double sum = 0;
-        for (uint64_t j = 0; j < data_dimension; j++) {
-          double val = dense_data[data_dimension * data_id + j];
-          if (random_bits[rep * hashes_per_table * data_dimension +
-                          bit * data_dimension + j] > 0) {
-            sum += val;
-          } else {
-            sum -= val;
-          }
+    single_srp(result.data() + data_id * num_tables * num_probes,
+               dense_data + data_dimension * data_id, data_dimension,
+               random_bits, num_tables, hashes_per_table, num_probes);
+  }
+
+  return result;
+}
+
+void single_l2_lsh(uint64_t *result, const float *point, uint64_t data_dimension,
+                   const int8_t *random_bits, uint64_t num_tables,
+                   uint64_t hashes_per_table, uint64_t sub_hash_bits,
+                   uint64_t cutoff, uint64_t num_probes,
+                   const float *bin_offsets, const float *bin_widths) {
+  const bool calibrated = bin_offsets != nullptr && bin_widths != nullptr;
+  uint64_t bin_width = calibrated ? 1 : 2 * cutoff / (1 << sub_hash_bits);
+  uint64_t num_bins = calibrated ? 1 << sub_hash_bits : cutoff / bin_width * 2;
+  double db_bin_width = static_cast<double>(bin_width);
+
+  std::vector<double> margins(num_probes > 1 ? hashes_per_table : 0);
+  std::vector<int64_t> shifts(margins.size());
+  std::vector<uint64_t> order;
+  for (uint64_t rep = 0; rep < num_tables; rep++) {
+    uint64_t hash = 0;
+    uint64_t accu = 1;
+    for (uint64_t bit = 0; bit < hashes_per_table; bit++) {
+      double sum = 0;
+      for (uint64_t j = 0; j < data_dimension; j++) {
+        double val = point[j];
+        if (random_bits[rep * hashes_per_table * data_dimension +
+                        bit * data_dimension + j] > 0) {
+          sum += val;
+        } else {
+          sum -= val;
         }
-        hash += (sum > 0) << bit;
       }
-      result[data_id * num_tables + rep] = hash;
+      double scaled = calibrated ? (sum - bin_offsets[rep * hashes_per_table + bit]) /
+                                   bin_widths[rep * hashes_per_table + bit]
+                                 : sum / db_bin_width;
+      sum = floor(scaled);
+      int64_t sub_hash = static_cast<int64_t>(sum) + num_bins / 2;
+      bool clamped = sub_hash < 0 || sub_hash >= static_cast<int64_t>(num_bins);
+      if (sub_hash < 0) {
+        sub_hash = 0;
+      } else if (sub_hash >= static_cast<int64_t>(num_bins)) {
+        sub_hash = num_bins - 1;
+      }
+      hash += static_cast<uint64_t>(sub_hash) * accu;
+      if (num_probes > 1) {
+        // The neighbor is the bin across the nearest boundary, none for
+        // projections clamped into the outermost bins
+        double offset = scaled - sum;
+        int64_t shift = offset < 0.5 ? -1 : 1;
+        bool inside = sub_hash + shift >= 0 && sub_hash + shift < static_cast<int64_t>(num_bins);
+        margins[bit] = !clamped && inside ? std::min(offset, 1 - offset) : no_margin;
+        shifts[bit] = shift * static_cast<int64_t>(accu);
+      }
+      accu *= 1 << sub_hash_bits;
+    }
+    uint64_t *probes = result + rep * num_probes;
+    probes[0] = hash;
+    if (num_probes > 1) {
+      least_confident(margins, num_probes - 1, order);
+      for (uint64_t p = 1; p < num_probes; p++) {
+        probes[p] = p <= order.size() ? hash + shifts[order[p - 1]] : no_probe;
+      }
     }
   }
-
-  return result;
 }
 
 std::vector<uint64_t> parallel_l2_lsh(const float *dense_data, uint64_t num_points,
@@ -138,42 +240,57 @@ std::vector<uint64_t> parallel_l2_lsh(const float *dense_data, uint64_t num_poin
                                       uint64_t num_tables,
                                       uint64_t hashes_per_table,
                                       uint64_t sub_hash_bits,
-                                      uint64_t cutoff) {
-  std::vector<uint64_t> result(num_tables * num_points);
-  uint64_t bin_width = 2 * cutoff / (1 << sub_hash_bits);
-  uint64_t num_bins = cutoff / bin_width * 2;
-  double db_bin_width = static_cast<double>(bin_width);
+                                      uint64_t cutoff,
+                                      uint64_t num_probes,
+                                      const float *bin_offsets,
+                                      const float *bin_widths) {
+  std::vector<uint64_t> result(num_tables * num_probes * num_points);
 
 #pragma omp parallel for
   for (uint64_t data_id = 0; data_id < num_points; data_id++) {
-    for (uint64_t rep = 0; rep < num_tables; rep++) {
-      uint64_t hash = 0;
-      uint64_t accu = 1;
-      for (uint64_t bit = 0; bit < hashes_per_table; bit++) {
-        double sum = 0;
-        for (uint64_t j = 0; j < data_dimension; j++) {
-          double val = dense_data[data_dimension * data_id + j];
-          if (random_bits[rep * hashes_per_table * data_dimension +
-                          bit * data_dimension + j] > 0) {
-            sum += val;
-          } else {
-            sum -= val;
-          }
-        }
-        sum = floor(sum / db_bin_width);
-        int64_t sub_hash = static_cast<int64_t>(sum) + num_bins / 2;
-        if (sub_hash < 0) {
-          sub_hash = 0;
-        } else if (sub_hash >= static_cast<int64_t>(num_bins)) {
-          sub_hash = num_bins - 1;
-        }
-        hash += static_cast<uint64_t>(sub_hash) * accu;
-        accu *= 1 << sub_hash_bits;
-      }
-      result[data_id * num_tables + rep] = hash;
-    }
+    single_l2_lsh(result.data() + data_id * num_tables * num_probes,
+                  dense_data + data_dimension * data_id, data_dimension,
+                  random_bits, num_tables, hashes_per_table, sub_hash_bits,
+                  cutoff, num_probes, bin_offsets, bin_widths);
   }
 
   return result;
 }
 
+void calibrate_l2_bins(const float *sample, uint64_t num_points, uint64_t data_dimension,
+                       const int8_t *random_bits, uint64_t num_tables, uint64_t hashes_per_table,
+                       uint64_t sub_hash_bits, std::vector<float> &bin_offsets,
+                       std::vector<float> &bin_widths) {
+  const uint64_t num_bins = 1 << sub_hash_bits;
+  bin_offsets.assign(num_tables * hashes_per_table, 0);
+  bin_widths.assign(num_tables * hashes_per_table, 1);
+  if (num_points == 0) {
+    return;
+  }
+
+#pragma omp parallel for
+  for (uint64_t projection = 0; projection < num_tables * hashes_per_table; projection++) {
+    const int8_t *bits = random_bits + projection * data_dimension;
+    std::vector<double> sums(num_points);
+    for (uint64_t i = 0; i < num_points; i++) {
+      double sum = 0;
+      for (uint64_t j = 0; j < data_dimension; j++) {
+        double val = sample[i * data_dimension + j];
+        sum += bits[j] > 0 ? val : -val;
+      }
+      sums[i] = sum;
+    }
+    auto quantile = [&](double q) {
+      auto nth = sums.begin() + static_cast<uint64_t>(q * (num_points - 1));
+      std::nth_element(sums.begin(), nth, sums.end());
+      return *nth;
+    };
+    // Two bins are split at the median alone, their width only scales the
+    // probing margins
+    double low = quantile(num_bins > 2 ? 1.0 / num_bins : 0.25);
+    double high = quantile(num_bins > 2 ? 1 - 1.0 / num_bins : 0.75);
+    double width = (high - low) / (num_bins > 2 ? num_bins - 2 : 1);
+    bin_offsets[projection] = quantile(0.5);
+    bin_widths[projection] = width > 0 ? width : 1;
+  }
+}
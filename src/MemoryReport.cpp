@@ -0,0 +1,46 @@
+#include "MemoryReport.h"
+
+namespace flinng {
+
+  MemoryUsage &MemoryUsage::operator+=(const MemoryUsage &other) {
+    used += other.used;
+    reserved += other.reserved;
+    overhead += other.overhead;
+    return *this;
+  }
+
+  uint64_t MemoryReport::total() const {
+    return posting_lists.total() + cell_membership.total() + labels.total() + signatures.total() + rand_bits.total() + bases.total() +
+           numa_replicas.total() + stats.total();
+  }
+
+  uint64_t MemoryReport::wasted() const {
+    return posting_lists.wasted() + cell_membership.wasted() + labels.wasted() + signatures.wasted() + rand_bits.wasted() + bases.wasted() +
+           numa_replicas.wasted() + stats.wasted();
+  }
+
+  MemoryReport &MemoryReport::operator+=(const MemoryReport &other) {
+    posting_lists += other.posting_lists;
+    cell_membership += other.cell_membership;
+    labels += other.labels;
+    signatures += other.signatures;
+    rand_bits += other.rand_bits;
+    bases += other.bases;
+    numa_replicas += other.numa_replicas;
+    stats += other.stats;
+    return *this;
+  }
+
+  void MemoryReport::print(std::ostream &out) const {
+    const char *names[] = {"posting lists", "cell membership", "labels", "signatures", "rand bits", "bases",
+                           "numa replicas", "stats"};
+    const MemoryUsage *parts[] = {&posting_lists, &cell_membership, &labels, &signatures, &rand_bits, &bases,
+                                  &numa_replicas, &stats};
+    for (uint64_t i = 0; i < 8; i++) {
+      out << names[i] << ": " << parts[i]->total() << " bytes (" << parts[i]->used << " used, "
+          << parts[i]->wasted() << " spare capacity, " << parts[i]->overhead << " overhead)\n";
+    }
+    out << "total: " << total() << " bytes, " << wasted() << " spare capacity" << std::endl;
+  }
+
+} //end namespace flinng
@@ -0,0 +1,76 @@
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include "NumaTopology.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace flinng {
+
+  std::vector<int> parse_id_list(const std::string &list) {
+    std::vector<int> ids;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+      if (range.empty() || range == "\n") {
+        continue;
+      }
+      size_t dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int id = first; id <= last; id++) {
+        ids.push_back(id);
+      }
+    }
+    return ids;
+  }
+
+  static bool read_line(const std::string &fname, std::string &line) {
+    std::ifstream in(fname);
+    return in && std::getline(in, line);
+  }
+
+  std::vector<NumaNode> numa_topology() {
+    std::vector<NumaNode> nodes;
+    std::string line;
+    if (read_line("/sys/devices/system/node/online", line)) {
+      for (int id: parse_id_list(line)) {
+        std::string cpulist;
+        if (!read_line("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist", cpulist)) {
+          continue;
+        }
+        NumaNode node = {id, parse_id_list(cpulist)};
+        if (!node.cpus.empty()) {
+          nodes.push_back(node);
+        }
+      }
+    }
+
+    if (nodes.empty()) {
+      NumaNode node = {0, {}};
+      unsigned num_cpus = std::max(1u, std::thread::hardware_concurrency());
+      for (unsigned cpu = 0; cpu < num_cpus; cpu++) {
+        node.cpus.push_back(cpu);
+      }
+      nodes.push_back(node);
+    }
+    return nodes;
+  }
+
+  bool pin_thread_to_node(const NumaNode &node) {
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu: node.cpus) {
+      CPU_SET(cpu, &mask);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+    return false;
+#endif
+  }
+
+} //end namespace flinng
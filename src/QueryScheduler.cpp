@@ -0,0 +1,164 @@
+#include <stdexcept>
+#include "QueryScheduler.h"
+
+namespace flinng {
+
+  QueryScheduler::QueryScheduler(BaseDenseFlinng32 &index, uint64_t max_batch_size,
+                                 std::chrono::microseconds max_delay, bool with_distance)
+      : index(index), dimension(index.dimension()), max_batch_size(std::max<uint64_t>(1, max_batch_size)),
+        max_delay(max_delay), with_distance(with_distance),
+        dispatcher(&QueryScheduler::dispatch_loop, this) {}
+
+  QueryScheduler::~QueryScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    dispatcher.join();
+  }
+
+  std::future<QueryScheduler::Result> QueryScheduler::submit(const float *query, uint32_t top_k) {
+    std::shared_ptr<std::promise<Result>> promise(new std::promise<Result>());
+    submit(query, top_k, [promise](Result &&result) {
+      if (result.error) {
+        promise->set_exception(result.error);
+      } else {
+        promise->set_value(std::move(result));
+      }
+    });
+    return promise->get_future();
+  }
+
+  void QueryScheduler::submit(const float *query, uint32_t top_k, Callback callback) {
+    submit(query, top_k, with_distance, std::move(callback));
+  }
+
+  void QueryScheduler::submit(const float *query, uint32_t top_k, bool with_distance, Callback callback) {
+    Request request;
+    request.query.assign(query, query + dimension);
+    request.top_k = top_k;
+    request.with_distance = with_distance;
+    request.callback = std::move(callback);
+    enqueue(std::move(request));
+  }
+
+  std::future<void> QueryScheduler::run_exclusive(std::function<void()> task) {
+    std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+    Request request;
+    request.task = [promise, task]() {
+      try {
+        task();
+        promise->set_value();
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    };
+    enqueue(std::move(request));
+    return promise->get_future();
+  }
+
+  void QueryScheduler::enqueue(Request &&request) {
+    request.submitted = std::chrono::steady_clock::now();
+    bool notify;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.push_back(std::move(request));
+      // The dispatcher only needs waking for a new batch or a full one
+      notify = pending.size() == 1 || pending.size() >= max_batch_size || pending.back().task;
+    }
+    if (notify) {
+      wake.notify_one();
+    }
+  }
+
+  void QueryScheduler::dispatch_loop() {
+    while (true) {
+      std::vector<Request> batch;
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]() { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+          return;
+        }
+
+        if (!pending.front().task) {
+          // Waits for the batch to fill up, at most until the oldest query
+          // reaches its deadline. A queued task also closes the batch.
+          std::chrono::steady_clock::time_point deadline = pending.front().submitted + max_delay;
+          wake.wait_until(lock, deadline, [this]() {
+            return stopping || pending.size() >= max_batch_size || pending.back().task;
+          });
+        }
+
+        if (pending.front().task) {
+          task = std::move(pending.front().task);
+          pending.pop_front();
+        } else {
+          while (!pending.empty() && !pending.front().task && batch.size() < max_batch_size) {
+            batch.push_back(std::move(pending.front()));
+            pending.pop_front();
+          }
+        }
+      }
+
+      if (task) {
+        task();
+      } else {
+        run_batch(batch);
+      }
+    }
+  }
+
+  void QueryScheduler::run_batch(std::vector<Request> &batch) {
+    uint32_t top_k = 0;
+    bool batch_distance = false;
+    std::vector<float> queries;
+    queries.reserve(batch.size() * dimension);
+    for (const Request &request: batch) {
+      top_k = std::max(top_k, request.top_k);
+      batch_distance = batch_distance || request.with_distance;
+      queries.insert(queries.end(), request.query.begin(), request.query.end());
+    }
+
+    // The batch runs with the largest top_k, every query gets its own prefix
+    std::vector<long> ids(batch.size() * top_k);
+    std::vector<float> distances(batch_distance ? batch.size() * top_k : 0);
+    std::exception_ptr error;
+    try {
+      // Distances are only computed for batches that hold a query asking for them
+      if (batch_distance) {
+        // search_with_distance would only print an error and leave the ids unset
+        if (!index.stores_dataset()) {
+          throw std::runtime_error("Dataset is not stored, distances cannot be computed");
+        }
+        index.search_with_distance(queries.data(), batch.size(), top_k, ids.data(), distances.data());
+      } else {
+        index.search(queries.data(), batch.size(), top_k, ids.data());
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    for (uint64_t i = 0; i < batch.size(); i++) {
+      Result result;
+      if (error) {
+        result.error = error;
+      } else {
+        result.ids.assign(ids.begin() + i * top_k, ids.begin() + i * top_k + batch[i].top_k);
+        if (batch[i].with_distance) {
+          result.distances.assign(distances.begin() + i * top_k, distances.begin() + i * top_k + batch[i].top_k);
+        }
+      }
+      try {
+        batch[i].callback(std::move(result));
+      } catch (const std::exception &e) {
+        std::cerr << "Query callback threw: " << e.what() << std::endl;
+      } catch (...) {
+        std::cerr << "Query callback threw" << std::endl;
+      }
+    }
+  }
+
+}; //end namespace flinng
@@ -0,0 +1,108 @@
+#include "QueryStats.h"
+
+namespace flinng {
+
+  bool stats_enabled() {
+#ifdef FLINNG_ENABLE_STATS
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  Histogram::Histogram() {
+    reset();
+  }
+
+  void Histogram::add(uint64_t value) {
+    uint32_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(value, std::memory_order_relaxed);
+    uint64_t current = maximum.load(std::memory_order_relaxed);
+    while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+  }
+
+  void Histogram::reset() {
+    for (std::atomic<uint64_t> &bucket: buckets) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    total.store(0, std::memory_order_relaxed);
+    maximum.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t Histogram::count() const {
+    uint64_t count = 0;
+    for (const std::atomic<uint64_t> &bucket: buckets) {
+      count += bucket.load(std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+  uint64_t Histogram::sum() const {
+    return total.load(std::memory_order_relaxed);
+  }
+
+  uint64_t Histogram::max() const {
+    return maximum.load(std::memory_order_relaxed);
+  }
+
+  double Histogram::mean() const {
+    uint64_t n = count();
+    return n == 0 ? 0 : static_cast<double>(sum()) / n;
+  }
+
+  uint64_t Histogram::percentile(double p) const {
+    uint64_t n = count();
+    if (n == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(p * (n - 1)) + 1, seen = 0;
+    for (uint32_t b = 0; b < num_buckets; b++) {
+      seen += buckets[b].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        uint64_t upper = b == 0 ? 0 : b == 64 ? UINT64_MAX : (1ull << b) - 1;
+        return upper < max() ? upper : max();
+      }
+    }
+    return max();
+  }
+
+  uint64_t Histogram::bucket_count(uint32_t bucket) const {
+    return buckets[bucket].load(std::memory_order_relaxed);
+  }
+
+  IndexStats::IndexStats(uint64_t num_posting_lists)
+      : num_posting_lists(num_posting_lists), reads(new std::atomic<uint32_t>[num_posting_lists]) {
+    reset();
+  }
+
+  void IndexStats::record(const QueryStats &stats) {
+    tables_probed.add(stats.tables_probed);
+    posting_entries_scanned.add(stats.posting_entries_scanned);
+    cells_hit.add(stats.cells_hit);
+    cells_visited.add(stats.cells_visited);
+    candidates_resolved.add(stats.candidates_resolved);
+    final_score.add(stats.final_score);
+    hash_ns.add(stats.hash_ns);
+    count_ns.add(stats.count_ns);
+    rank_ns.add(stats.rank_ns);
+    resolve_ns.add(stats.resolve_ns);
+    total_ns.add(stats.total_ns());
+  }
+
+  void IndexStats::reset() {
+    for (Histogram *histogram: {&tables_probed, &posting_entries_scanned, &cells_hit, &cells_visited,
+                                &candidates_resolved, &final_score, &hash_ns, &count_ns, &rank_ns, &resolve_ns,
+                                &total_ns}) {
+      histogram->reset();
+    }
+    for (uint64_t i = 0; i < num_posting_lists; i++) {
+      reads[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t IndexStats::posting_list_reads(uint64_t posting_list) const {
+    return reads[posting_list].load(std::memory_order_relaxed);
+  }
+
+} //end namespace flinng
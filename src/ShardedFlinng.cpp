@@ -0,0 +1,418 @@
+#include <string>
+#include "ShardedFlinng.h"
+
+namespace flinng {
+
+  static std::string shard_file_name(const char *fname, uint64_t shard) {
+    return std::string(fname) + ".shard" + std::to_string(shard);
+  }
+
+  // Spreads num_points new points (global ids starting at first_id) over the
+  // shards proportionally to their cells_per_row, returns the shard of each
+  static std::vector<uint64_t> assign_to_shards(const std::vector<uint64_t> &shard_cells,
+                                                std::vector<std::vector<uint64_t>> &shard_ids,
+                                                uint64_t first_id, uint64_t num_points) {
+    std::vector<uint64_t> assignment(num_points);
+    for (uint64_t point = 0; point < num_points; point++) {
+      uint64_t best = 0;
+      for (uint64_t s = 1; s < shard_cells.size(); s++) {
+        // Compare (size_s + 1) / cells_s without dividing
+        if ((shard_ids[s].size() + 1) * shard_cells[best] < (shard_ids[best].size() + 1) * shard_cells[s]) {
+          best = s;
+        }
+      }
+      assignment[point] = best;
+      shard_ids[best].push_back(first_id + point);
+    }
+    return assignment;
+  }
+
+  // Queries every shard with the same hashes in one parallel pass over
+  // (shard, query) pairs. Candidates are laid out as [query][shard][top_k]
+  static void fan_out(const std::vector<const Flinng *> &flinngs,
+                      const std::vector<std::vector<uint64_t>> &shard_ids,
+                      const std::vector<uint64_t> &hashes, uint64_t num_hash_tables,
+                      uint64_t top_k, std::vector<uint64_t> &candidates,
+                      std::vector<uint32_t> &scores) {
+    uint64_t num_shards = flinngs.size();
+    uint64_t num_queries = hashes.size() / num_hash_tables;
+    candidates.assign(num_queries * num_shards * top_k, 0);
+    scores.assign(num_queries * num_shards * top_k, 0);
+
+#pragma omp parallel for
+    for (uint64_t task = 0; task < num_queries * num_shards; task++) {
+      uint64_t query_id = task / num_shards, shard = task % num_shards;
+      uint64_t shard_k = std::min<uint64_t>(top_k, shard_ids[shard].size());
+      if (shard_k == 0) {
+        continue;
+      }
+      flinngs[shard]->query_one(hashes.data() + num_hash_tables * query_id, shard_k,
+                                candidates.data() + task * top_k, scores.data() + task * top_k);
+      // Slots query_one could not fill stay UINT64_MAX
+      for (uint64_t i = 0; i < shard_k; i++) {
+        uint64_t &candidate = candidates[task * top_k + i];
+        if (candidate != UINT64_MAX) {
+          candidate = shard_ids[shard][candidate];
+        }
+      }
+    }
+  }
+
+  // Merges the per-shard candidates of each query in ascending order of keys
+  // (laid out like the candidates). Ties are broken by per-shard rank so that
+  // equally scored shards are interleaved. Missing results are set to -1.
+  static void merge_candidates(const std::vector<std::vector<uint64_t>> &shard_ids,
+                               const std::vector<uint64_t> &candidates, const std::vector<float> &keys,
+                               uint64_t num_queries, uint64_t top_k, long *ids, float *distances) {
+    uint64_t num_shards = shard_ids.size();
+
+#pragma omp parallel for
+    for (uint64_t query_id = 0; query_id < num_queries; query_id++) {
+      std::vector<uint64_t> order;
+      for (uint64_t rank = 0; rank < top_k; rank++) {
+        for (uint64_t shard = 0; shard < num_shards; shard++) {
+          uint64_t index = (query_id * num_shards + shard) * top_k + rank;
+          if (rank < shard_ids[shard].size() && candidates[index] != UINT64_MAX) {
+            order.push_back(index);
+          }
+        }
+      }
+      std::stable_sort(order.begin(), order.end(), [&keys](uint64_t a, uint64_t b) {
+        return keys[a] < keys[b];
+      });
+
+      for (uint64_t i = 0; i < top_k; i++) {
+        if (i < order.size()) {
+          ids[query_id * top_k + i] = candidates[order[i]];
+          if (distances != nullptr) {
+            distances[query_id * top_k + i] = keys[order[i]];
+          }
+        } else {
+          ids[query_id * top_k + i] = -1;
+        }
+      }
+    }
+  }
+
+  static void write_manifest(FileIO &index, uint64_t total_points_added,
+                             const std::vector<uint64_t> &shard_cells,
+                             const std::vector<std::vector<uint64_t>> &shard_ids) {
+    size_t tmp = shard_cells.size();
+    write_verify(&tmp, sizeof(size_t), 1, index);
+    write_verify(&total_points_added, sizeof(total_points_added), 1, index);
+    write_verify((void *) shard_cells.data(), sizeof(uint64_t), tmp, index);
+    for (size_t i = 0; i < shard_ids.size(); i++) {
+      size_t tmp2 = shard_ids[i].size();
+      write_verify(&tmp2, sizeof(size_t), 1, index);
+      write_verify((void *) shard_ids[i].data(), sizeof(uint64_t), tmp2, index);
+    }
+  }
+
+  static void read_manifest(FileIO &index, uint64_t &total_points_added,
+                            std::vector<uint64_t> &shard_cells,
+                            std::vector<std::vector<uint64_t>> &shard_ids) {
+    size_t tmp;
+    read_verify(&tmp, sizeof(size_t), 1, index);
+    read_verify(&total_points_added, sizeof(total_points_added), 1, index);
+    shard_cells.resize(tmp);
+    read_verify(shard_cells.data(), sizeof(uint64_t), tmp, index);
+    shard_ids.resize(tmp);
+    for (size_t i = 0; i < tmp; i++) {
+      size_t tmp2;
+      read_verify(&tmp2, sizeof(size_t), 1, index);
+      shard_ids[i].resize(tmp2);
+      read_verify(shard_ids[i].data(), sizeof(uint64_t), tmp2, index);
+    }
+  }
+
+  ShardedDenseFlinng32::ShardedDenseFlinng32(uint64_t data_dimension, const std::vector<uint64_t> &cells_per_row,
+                                             FlinngBuilder *def, bool use_l2)
+      : shard_cells(cells_per_row), shard_ids(cells_per_row.size()), data_dimension(data_dimension) {
+    if (cells_per_row.empty()) {
+      throw std::invalid_argument("A sharded index needs at least 1 shard.");
+    }
+    FlinngBuilder spec = def == nullptr ? FlinngBuilder() : *def;
+    for (uint64_t cells: cells_per_row) {
+      spec.cells_per_row = cells;
+      if (use_l2) {
+        shards.emplace_back(new L2DenseFlinng32(data_dimension, &spec));
+      } else {
+        shards.emplace_back(new DenseFlinng32(data_dimension, &spec));
+      }
+      // Share the hash functions so that queries are only hashed once
+      shards.back()->rand_bits = shards.front()->rand_bits;
+    }
+  }
+
+  void ShardedDenseFlinng32::add_to_shards(float *input, uint64_t num_items, bool store) {
+    if (total_points_added == 0) {
+      // Calibrating every shard on the whole first batch keeps their hash
+      // functions identical
+      for (auto &shard: shards) {
+        shard->calibrate_hashes(input, num_items);
+      }
+    }
+    std::vector<uint64_t> assignment = assign_to_shards(shard_cells, shard_ids, total_points_added, num_items);
+    total_points_added += num_items;
+
+    for (uint64_t shard = 0; shard < shards.size(); shard++) {
+      std::vector<float> batch;
+      for (uint64_t point = 0; point < num_items; point++) {
+        if (assignment[point] == shard) {
+          batch.insert(batch.end(), input + point * data_dimension, input + (point + 1) * data_dimension);
+        }
+      }
+      if (batch.empty()) {
+        continue;
+      }
+      if (store) {
+        shards[shard]->add_and_store(batch.data(), batch.size() / data_dimension);
+      } else {
+        shards[shard]->add(batch.data(), batch.size() / data_dimension);
+      }
+    }
+  }
+
+  void ShardedDenseFlinng32::add(float *x, uint64_t num) {
+    add_to_shards(x, num, false);
+  }
+
+  void ShardedDenseFlinng32::add_and_store(float *input, uint64_t num_items) {
+    add_to_shards(input, num_items, true);
+  }
+
+  void ShardedDenseFlinng32::finalize_construction() {
+    for (auto &shard: shards) {
+      shard->finalize_construction();
+    }
+  }
+
+  void ShardedDenseFlinng32::search(float *queries, unsigned n, unsigned k, long *ids) {
+    std::vector<const Flinng *> flinngs;
+    for (auto &shard: shards) {
+      flinngs.push_back(&shard->internal_flinng);
+    }
+
+    std::vector<uint64_t> hashes = shards.front()->hashPoints(queries, n);
+    std::vector<uint64_t> candidates;
+    std::vector<uint32_t> scores;
+    fan_out(flinngs, shard_ids, hashes, shards.front()->num_hash_tables, k, candidates, scores);
+
+    std::vector<float> keys(scores.size());
+    for (uint64_t i = 0; i < scores.size(); i++) {
+      keys[i] = -static_cast<float>(scores[i]);
+    }
+    merge_candidates(shard_ids, candidates, keys, n, k, ids, nullptr);
+  }
+
+  void ShardedDenseFlinng32::search_with_distance(float *queries, unsigned n, unsigned k, long *ids,
+                                                  float *distances) {
+    std::vector<const Flinng *> flinngs;
+    for (uint64_t shard = 0; shard < shards.size(); shard++) {
+      if (shards[shard]->bases.size() / data_dimension != shard_ids[shard].size()) {
+        std::cerr << "Dataset is not stored! Distance cannot be calculated. Invoke add_with_store() to store dataset."
+                  << std::endl;
+        return;
+      }
+      flinngs.push_back(&shards[shard]->internal_flinng);
+    }
+
+    std::vector<uint64_t> hashes = shards.front()->hashPoints(queries, n);
+    std::vector<uint64_t> candidates;
+    std::vector<uint32_t> scores;
+    fan_out(flinngs, shard_ids, hashes, shards.front()->num_hash_tables, k, candidates, scores);
+
+    // Distances are computed against the shard-local copy of each candidate,
+    // whose local id is its position in the shard's id list
+    uint64_t num_shards = shards.size();
+    std::vector<float> keys(candidates.size(), 0);
+#pragma omp parallel for
+    for (uint64_t task = 0; task < n * num_shards; task++) {
+      uint64_t query_id = task / num_shards, shard = task % num_shards;
+      const std::vector<uint64_t> &ids_of_shard = shard_ids[shard];
+      uint64_t shard_k = std::min<uint64_t>(k, ids_of_shard.size());
+      for (uint64_t i = 0; i < shard_k && candidates[task * k + i] != UINT64_MAX; i++) {
+        uint64_t local = std::lower_bound(ids_of_shard.begin(), ids_of_shard.end(), candidates[task * k + i]) -
+                         ids_of_shard.begin();
+        keys[task * k + i] = shards[shard]->compute_distance(queries + data_dimension * query_id,
+                                                            shards[shard]->bases.data() + data_dimension * local);
+      }
+    }
+    merge_candidates(shard_ids, candidates, keys, n, k, ids, distances);
+  }
+
+  void ShardedDenseFlinng32::write_index(const char *fname) {
+    FileIO idx_stream(fname, true);
+    if (idx_stream.fp == NULL) {
+      std::cerr << "Error occurred while opening index file for writing" << std::endl;
+      return;
+    }
+
+    write_verify(&data_dimension, sizeof(data_dimension), 1, idx_stream);
+    write_manifest(idx_stream, total_points_added, shard_cells, shard_ids);
+    for (uint64_t shard = 0; shard < shards.size(); shard++) {
+      shards[shard]->write_index(shard_file_name(fname, shard).c_str());
+    }
+  }
+
+  ShardedDenseFlinng32 *ShardedDenseFlinng32::from_index(const char *fname) {
+    FileIO idx_stream(fname);
+    if (idx_stream.fp == NULL) {
+      std::cerr << "Error occurred while opening index file for reading" << std::endl;
+      return nullptr;
+    }
+
+    ShardedDenseFlinng32 *obj = new ShardedDenseFlinng32();
+    read_verify(&obj->data_dimension, sizeof(obj->data_dimension), 1, idx_stream);
+    read_manifest(idx_stream, obj->total_points_added, obj->shard_cells, obj->shard_ids);
+    for (uint64_t shard = 0; shard < obj->shard_cells.size(); shard++) {
+      BaseDenseFlinng32 *loaded = BaseDenseFlinng32::from_index(shard_file_name(fname, shard).c_str());
+      if (loaded == nullptr) {
+        delete obj;
+        return nullptr;
+      }
+      obj->shards.emplace_back(loaded);
+    }
+
+    return obj;
+  }
+
+  uint64_t ShardedDenseFlinng32::num_shards() const {
+    return shards.size();
+  }
+
+  uint64_t ShardedDenseFlinng32::num_points_added() const {
+    return total_points_added;
+  }
+
+  ShardedSparseFlinng32::ShardedSparseFlinng32(uint64_t num_rows, const std::vector<uint64_t> &cells_per_row,
+                                               uint64_t num_hash_tables, uint64_t hashes_per_table,
+                                               uint64_t hash_range_pow)
+      : shard_cells(cells_per_row), shard_ids(cells_per_row.size()) {
+    if (cells_per_row.empty()) {
+      throw std::invalid_argument("A sharded index needs at least 1 shard.");
+    }
+    uint32_t seed = rand();
+    for (uint64_t cells: cells_per_row) {
+      shards.emplace_back(new SparseFlinng32(num_rows, cells, num_hash_tables, hashes_per_table,
+                                             hash_range_pow, seed));
+    }
+  }
+
+  void ShardedSparseFlinng32::addPointsSameDim(const uint64_t *points, uint64_t num_points,
+                                               uint64_t point_dimension) {
+    std::vector<uint64_t> assignment = assign_to_shards(shard_cells, shard_ids, total_points_added, num_points);
+    total_points_added += num_points;
+
+    for (uint64_t shard = 0; shard < shards.size(); shard++) {
+      std::vector<uint64_t> batch;
+      for (uint64_t point = 0; point < num_points; point++) {
+        if (assignment[point] == shard) {
+          batch.insert(batch.end(), points + point * point_dimension, points + (point + 1) * point_dimension);
+        }
+      }
+      if (!batch.empty()) {
+        shards[shard]->addPointsSameDim(batch, batch.size() / point_dimension, point_dimension);
+      }
+    }
+  }
+
+  void ShardedSparseFlinng32::addPoints(const std::vector<std::vector<uint64_t>> &data) {
+    std::vector<uint64_t> assignment = assign_to_shards(shard_cells, shard_ids, total_points_added, data.size());
+    total_points_added += data.size();
+
+    for (uint64_t shard = 0; shard < shards.size(); shard++) {
+      std::vector<std::vector<uint64_t>> batch;
+      for (uint64_t point = 0; point < data.size(); point++) {
+        if (assignment[point] == shard) {
+          batch.push_back(data[point]);
+        }
+      }
+      if (!batch.empty()) {
+        shards[shard]->addPoints(batch);
+      }
+    }
+  }
+
+  void ShardedSparseFlinng32::prepareForQueries() {
+    for (auto &shard: shards) {
+      shard->prepareForQueries();
+    }
+  }
+
+  std::vector<uint64_t> ShardedSparseFlinng32::query_hashes(const std::vector<uint64_t> &hashes, uint64_t top_k) {
+    std::vector<const Flinng *> flinngs;
+    for (auto &shard: shards) {
+      flinngs.push_back(&shard->internal_flinng);
+    }
+
+    std::vector<uint64_t> candidates;
+    std::vector<uint32_t> scores;
+    uint64_t num_hash_tables = shards.front()->num_hash_tables;
+    fan_out(flinngs, shard_ids, hashes, num_hash_tables, top_k, candidates, scores);
+
+    std::vector<float> keys(scores.size());
+    for (uint64_t i = 0; i < scores.size(); i++) {
+      keys[i] = -static_cast<float>(scores[i]);
+    }
+    uint64_t num_queries = hashes.size() / num_hash_tables;
+    std::vector<long> ids(num_queries * top_k);
+    merge_candidates(shard_ids, candidates, keys, num_queries, top_k, ids.data(), nullptr);
+
+    return std::vector<uint64_t>(ids.begin(), ids.end());
+  }
+
+  std::vector<uint64_t> ShardedSparseFlinng32::query(const std::vector<std::vector<uint64_t>> &queries,
+                                                     uint64_t top_k) {
+    return query_hashes(shards.front()->getHashes(queries), top_k);
+  }
+
+  std::vector<uint64_t>
+  ShardedSparseFlinng32::querySameDim(const std::vector<uint64_t> &queries, uint64_t num_points,
+                                      uint64_t point_dimension, uint64_t top_k) {
+    return query_hashes(shards.front()->getHashes(queries.data(), num_points, point_dimension), top_k);
+  }
+
+  void ShardedSparseFlinng32::write_index(const char *fname) {
+    FileIO idx_stream(fname, true);
+    if (idx_stream.fp == NULL) {
+      std::cerr << "Error occurred while opening index file for writing" << std::endl;
+      return;
+    }
+
+    write_manifest(idx_stream, total_points_added, shard_cells, shard_ids);
+    for (uint64_t shard = 0; shard < shards.size(); shard++) {
+      shards[shard]->write_index(shard_file_name(fname, shard).c_str());
+    }
+  }
+
+  ShardedSparseFlinng32 *ShardedSparseFlinng32::from_index(const char *fname) {
+    FileIO idx_stream(fname);
+    if (idx_stream.fp == NULL) {
+      std::cerr << "Error occurred while opening index file for reading" << std::endl;
+      return nullptr;
+    }
+
+    ShardedSparseFlinng32 *obj = new ShardedSparseFlinng32();
+    read_manifest(idx_stream, obj->total_points_added, obj->shard_cells, obj->shard_ids);
+    for (uint64_t shard = 0; shard < obj->shard_cells.size(); shard++) {
+      SparseFlinng32 *loaded = SparseFlinng32::from_index(shard_file_name(fname, shard).c_str());
+      if (loaded == nullptr) {
+        delete obj;
+        return nullptr;
+      }
+      obj->shards.emplace_back(loaded);
+    }
+
+    return obj;
+  }
+
+  uint64_t ShardedSparseFlinng32::num_shards() const {
+    return shards.size();
+  }
+
+  uint64_t ShardedSparseFlinng32::num_points_added() const {
+    return total_points_added;
+  }
+
+}; //end namespace flinng
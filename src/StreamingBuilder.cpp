@@ -0,0 +1,490 @@
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <queue>
+#include <unistd.h>
+#include "StreamingBuilder.h"
+
+namespace flinng {
+
+  // Buffered sequential reader over a section of uint64_t values in a run file
+  class RunCursor {
+
+  public:
+    RunCursor(FILE *fp, uint64_t offset, uint64_t count) : fp(fp), remaining(count) {
+      fseek(fp, offset, SEEK_SET);
+      fill();
+    }
+
+    bool done() const { return pos == buffer.size(); }
+
+    bool failed() const { return read_error; }
+
+    uint64_t peek() const { return buffer[pos]; }
+
+    void next() {
+      if (++pos == buffer.size()) {
+        fill();
+      }
+    }
+
+  private:
+    static const uint64_t buffer_size = 1 << 12;
+    FILE *fp;
+    uint64_t remaining;
+    std::vector<uint64_t> buffer;
+    uint64_t pos = 0;
+    bool read_error = false;
+
+    void fill() {
+      buffer.resize(std::min(remaining, buffer_size));
+      size_t ret = fread(buffer.data(), sizeof(uint64_t), buffer.size(), fp);
+      if (ret != buffer.size()) {
+        std::cerr << "Error while reading run file, ret==" << ret << " != count==" << buffer.size() << std::endl;
+        buffer.resize(ret);
+        read_error = true;
+      }
+      remaining -= buffer.size();
+      pos = 0;
+    }
+  };
+
+  typedef std::vector<std::unique_ptr<RunCursor>> Cursors;
+
+  static bool any_failed(const Cursors &cursors) {
+    for (const std::unique_ptr<RunCursor> &cursor: cursors) {
+      if (cursor->failed()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Calls emit with every distinct value of the sorted sections in ascending order
+  static void merge_sections(Cursors &cursors, const std::function<void(uint64_t)> &emit) {
+    typedef std::pair<uint64_t, uint64_t> HeapEntry; /// (value, cursor)
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> heap;
+    for (uint64_t c = 0; c < cursors.size(); c++) {
+      if (!cursors[c]->done()) {
+        heap.push(HeapEntry(cursors[c]->peek(), c));
+      }
+    }
+    bool first = true;
+    uint64_t last = 0;
+    while (!heap.empty()) {
+      HeapEntry top = heap.top();
+      heap.pop();
+      if (first || top.first != last) {
+        emit(top.first);
+      }
+      first = false;
+      last = top.first;
+      RunCursor &cursor = *cursors[top.second];
+      cursor.next();
+      if (!cursor.done()) {
+        heap.push(HeapEntry(cursor.peek(), top.second));
+      }
+    }
+  }
+
+  // Calls emit with the (cell, point) pairs of every cell in order. Runs hold
+  // increasing point ids, so each cell is the concatenation of its pairs in
+  // every run.
+  static void merge_memberships(Cursors &cursors, uint64_t num_cells,
+                                const std::function<void(uint64_t, uint64_t)> &emit) {
+    for (uint64_t cell = 0; cell < num_cells; cell++) {
+      for (std::unique_ptr<RunCursor> &cursor: cursors) {
+        while (!cursor->done() && cursor->peek() == cell) {
+          cursor->next();
+          uint64_t point = cursor->peek();
+          cursor->next();
+          emit(cell, point);
+        }
+      }
+    }
+  }
+
+  static std::atomic<uint64_t> num_builders(0);
+
+  StreamingIndexBuilder::StreamingIndexBuilder(BaseDenseFlinng32 &index, const char *tmp_dir,
+                                               uint64_t chunk_size, bool store, uint64_t max_open_runs)
+      : index(index),
+        file_prefix(std::string(tmp_dir) + "/flinng_" + std::to_string(getpid()) + "_" +
+                    std::to_string(num_builders++)),
+        chunk_size(chunk_size), store(store), max_open_runs(std::max<uint64_t>(2, max_open_runs)),
+        bases_fname(file_prefix + "_bases") {
+    if (index.num_points_added() != 0) {
+      throw std::invalid_argument("The streaming builder must start from an empty index.");
+    }
+    if (index.stores_signatures()) {
+      throw std::invalid_argument("The streaming builder does not keep signatures.");
+    }
+    // Posting entries are packed as (hash << 32 | cell)
+    const Flinng &flinng = index.internal_flinng;
+    const uint64_t max_packed = (uint64_t) 1 << 32;
+    if (flinng.hash_range > max_packed || flinng.num_rows * flinng.cells_per_row > max_packed) {
+      throw std::invalid_argument("The streaming builder needs a hash range and a number of cells of at most 2^32.");
+    }
+    if (store) {
+      bases_file.reset(new FileIO(bases_fname.c_str(), true));
+      if (bases_file->fp == NULL) {
+        throw std::runtime_error("Error occurred while opening " + bases_fname + " for writing");
+      }
+    }
+  }
+
+  StreamingIndexBuilder::~StreamingIndexBuilder() {
+    remove_tmp_files();
+  }
+
+  void StreamingIndexBuilder::add_file(const char *fname, VectorFormat format, uint64_t dimension) {
+    VectorFileReader reader(fname, format, dimension);
+    if (!reader.good() || reader.dimension() != index.data_dimension) {
+      throw std::invalid_argument(std::string("Cannot read vectors of dimension ") +
+                                  std::to_string(index.data_dimension) + " from " + fname);
+    }
+    std::vector<float> chunk;
+    while (uint64_t num_read = reader.read(chunk, chunk_size)) {
+      spill(chunk.data(), num_read);
+    }
+  }
+
+  void StreamingIndexBuilder::add(const float *points, uint64_t num_points) {
+    for (uint64_t begin = 0; begin < num_points; begin += chunk_size) {
+      spill(points + begin * index.data_dimension, std::min(chunk_size, num_points - begin));
+    }
+  }
+
+  // Run file layout: for every table its sorted, deduplicated posting entries
+  // encoded as (hash << 32 | cell), followed by (cell, point) pairs sorted by
+  // cell and then point
+  void StreamingIndexBuilder::spill(const float *points, uint64_t num_points) {
+    if (finished) {
+      throw std::logic_error("Points cannot be added once the index has been written.");
+    }
+    const Flinng &flinng = index.internal_flinng;
+    const uint64_t num_rows = flinng.num_rows, cells_per_row = flinng.cells_per_row;
+    const uint64_t num_tables = flinng.num_hash_tables;
+
+    // The index stays empty, so the first run stands in for its first add
+    if (total_points_added == 0) {
+      index.calibrate_hashes(points, num_points);
+    }
+    std::vector<uint64_t> hashes = index.hashPoints(points, num_points);
+
+    // Same cell assignment as Flinng::addPoints
+    std::vector<uint64_t> random_buckets(num_rows * num_points);
+    for (uint64_t i = 0; i < num_rows * num_points; i++) {
+      random_buckets[i] =
+          (rand() % cells_per_row + cells_per_row) % cells_per_row +
+          (i % num_rows) * cells_per_row;
+    }
+
+    std::vector<std::vector<uint64_t>> postings(num_tables);
+#pragma omp parallel for
+    for (uint64_t table = 0; table < num_tables; table++) {
+      std::vector<uint64_t> &entries = postings[table];
+      entries.reserve(num_points * num_rows);
+      for (uint64_t point = 0; point < num_points; point++) {
+        uint64_t hash = hashes[point * num_tables + table];
+        for (uint64_t row = 0; row < num_rows; row++) {
+          entries.push_back(hash << 32 | random_buckets[point * num_rows + row]);
+        }
+      }
+      std::sort(entries.begin(), entries.end());
+      entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> memberships(num_rows * num_points);
+    for (uint64_t i = 0; i < num_rows * num_points; i++) {
+      memberships[i] = std::make_pair(random_buckets[i], total_points_added + i / num_rows);
+    }
+    std::sort(memberships.begin(), memberships.end());
+
+    Run run;
+    run.fname = run_file_name();
+    run.num_points = num_points;
+    FileIO run_file(run.fname.c_str(), true);
+    if (run_file.fp == NULL) {
+      throw std::runtime_error("Error occurred while opening run file " + run.fname + " for writing");
+    }
+    for (std::vector<uint64_t> &entries: postings) {
+      run.table_sizes.push_back(entries.size());
+      write_verify(entries.data(), sizeof(uint64_t), entries.size(), run_file);
+      std::vector<uint64_t>().swap(entries);
+    }
+    write_verify(memberships.data(), sizeof(uint64_t), 2 * memberships.size(), run_file);
+    runs.push_back(run);
+
+    if (store) {
+      write_verify(const_cast<float *>(points), sizeof(float), num_points * index.data_dimension, *bases_file);
+    }
+
+    total_points_added += num_points;
+  }
+
+  std::string StreamingIndexBuilder::run_file_name() {
+    return file_prefix + "_run" + std::to_string(next_run++);
+  }
+
+  bool StreamingIndexBuilder::merge_runs(uint64_t first, uint64_t last, Run &merged) {
+    std::vector<std::unique_ptr<FileIO>> run_files;
+    for (uint64_t r = first; r < last; r++) {
+      run_files.emplace_back(new FileIO(runs[r].fname.c_str()));
+      if (run_files.back()->fp == NULL) {
+        std::cerr << "Error occurred while opening run file " << runs[r].fname << " for reading" << std::endl;
+        return false;
+      }
+    }
+    merged.fname = run_file_name();
+    merged.num_points = 0;
+    merged.table_sizes.clear();
+    bool ok = true;
+    {
+      FileIO merged_file(merged.fname.c_str(), true);
+      if (merged_file.fp == NULL) {
+        std::cerr << "Error occurred while opening run file " << merged.fname << " for writing" << std::endl;
+        return false;
+      }
+
+      const Flinng &flinng = index.internal_flinng;
+      std::vector<uint64_t> section_offsets(last - first, 0);
+      for (uint64_t table = 0; table < flinng.num_hash_tables; table++) {
+        Cursors cursors;
+        for (uint64_t r = first; r < last; r++) {
+          uint64_t count = runs[r].table_sizes[table];
+          cursors.emplace_back(new RunCursor(run_files[r - first]->fp, section_offsets[r - first], count));
+          section_offsets[r - first] += count * sizeof(uint64_t);
+        }
+        uint64_t size = 0;
+        merge_sections(cursors, [&](uint64_t entry) {
+          write_verify(&entry, sizeof(uint64_t), 1, merged_file);
+          size++;
+        });
+        merged.table_sizes.push_back(size);
+        ok = !any_failed(cursors);
+        if (!ok) {
+          break;
+        }
+      }
+
+      Cursors cursors;
+      for (uint64_t r = first; r < last && ok; r++) {
+        merged.num_points += runs[r].num_points;
+        cursors.emplace_back(new RunCursor(run_files[r - first]->fp, section_offsets[r - first],
+                                           2 * runs[r].num_points * flinng.num_rows));
+      }
+      merge_memberships(cursors, ok ? flinng.num_rows * flinng.cells_per_row : 0, [&](uint64_t cell, uint64_t point) {
+        uint64_t pair[2] = {cell, point};
+        write_verify(pair, sizeof(uint64_t), 2, merged_file);
+      });
+      ok = ok && !any_failed(cursors) && fflush(merged_file.fp) == 0 && !ferror(merged_file.fp);
+    }
+    if (!ok) {
+      std::cerr << "Error occurred while merging runs into " << merged.fname << std::endl;
+      std::remove(merged.fname.c_str());
+    }
+    return ok;
+  }
+
+  bool StreamingIndexBuilder::merge_level() {
+    std::vector<Run> level;
+    for (uint64_t first = 0; first < runs.size(); first += max_open_runs) {
+      uint64_t last = std::min<uint64_t>(runs.size(), first + max_open_runs);
+      Run merged;
+      if (last - first == 1) {
+        level.push_back(runs[first]);
+      } else if (merge_runs(first, last, merged)) {
+        for (uint64_t r = first; r < last; r++) {
+          std::remove(runs[r].fname.c_str());
+        }
+        level.push_back(merged);
+      } else {
+        // Runs are in point order, so the unmerged ones simply follow
+        level.insert(level.end(), runs.begin() + first, runs.end());
+        runs.swap(level);
+        return false;
+      }
+    }
+    runs.swap(level);
+    return true;
+  }
+
+  void StreamingIndexBuilder::write_index(const char *fname) {
+    if (finished) {
+      throw std::logic_error("The index has already been written.");
+    }
+    while (runs.size() > max_open_runs) {
+      if (!merge_level()) {
+        return;
+      }
+    }
+    if (store && fflush(bases_file->fp) != 0) {
+      std::cerr << "Error occurred while writing " << bases_fname << std::endl;
+      return;
+    }
+
+    std::string partial_fname = std::string(fname) + ".partial";
+    bool ok;
+    {
+      FileIO idx_stream(partial_fname.c_str(), true);
+      if (idx_stream.fp == NULL) {
+        std::cerr << "Error occurred while opening index file for writing" << std::endl;
+        return;
+      }
+
+      std::vector<std::unique_ptr<FileIO>> run_files;
+      for (const Run &run: runs) {
+        run_files.emplace_back(new FileIO(run.fname.c_str()));
+        if (run_files.back()->fp == NULL) {
+          std::cerr << "Error occurred while opening run file " << run.fname << " for reading" << std::endl;
+          run_files.clear();
+          std::remove(partial_fname.c_str());
+          return;
+        }
+      }
+
+      Flinng &flinng = index.internal_flinng;
+      uint64_t num_rows = flinng.num_rows, cells_per_row = flinng.cells_per_row;
+      uint64_t num_tables = flinng.num_hash_tables, hash_range = flinng.hash_range;
+
+      // Same layout as Flinng::write_content_to_index
+      index.write_type_to_index(idx_stream);
+      write_verify(&num_rows, sizeof(num_rows), 1, idx_stream);
+      write_verify(&cells_per_row, sizeof(cells_per_row), 1, idx_stream);
+      write_verify(&num_tables, sizeof(num_tables), 1, idx_stream);
+      write_verify(&hash_range, sizeof(hash_range), 1, idx_stream);
+      write_verify(&total_points_added, sizeof(total_points_added), 1, idx_stream);
+
+      ok = true;
+      size_t tmp = hash_range * num_tables;
+      write_verify(&tmp, sizeof(size_t), 1, idx_stream);
+      std::vector<uint64_t> section_offsets(runs.size(), 0);
+      for (uint64_t table = 0; table < num_tables && ok; table++) {
+        Cursors cursors;
+        for (uint64_t r = 0; r < runs.size(); r++) {
+          cursors.emplace_back(new RunCursor(run_files[r]->fp, section_offsets[r], runs[r].table_sizes[table]));
+          section_offsets[r] += runs[r].table_sizes[table] * sizeof(uint64_t);
+        }
+
+        // Every bucket is written, empty ones with size 0
+        uint64_t next_hash = 0;
+        auto write_bucket = [&](uint64_t hash, const std::vector<uint32_t> &bucket) {
+          size_t empty = 0;
+          for (; next_hash < hash; next_hash++) {
+            write_verify(&empty, sizeof(size_t), 1, idx_stream);
+          }
+          size_t size = bucket.size();
+          write_verify(&size, sizeof(size_t), 1, idx_stream);
+          write_verify((void *) bucket.data(), sizeof(uint32_t), size, idx_stream);
+          next_hash = hash + 1;
+        };
+
+        std::vector<uint32_t> bucket;
+        uint64_t bucket_hash = 0;
+        merge_sections(cursors, [&](uint64_t entry) {
+          uint64_t hash = entry >> 32;
+          if (!bucket.empty() && hash != bucket_hash) {
+            write_bucket(bucket_hash, bucket);
+            bucket.clear();
+          }
+          bucket_hash = hash;
+          bucket.push_back(entry & 0xFFFFFFFF);
+        });
+        if (!bucket.empty()) {
+          write_bucket(bucket_hash, bucket);
+        }
+        size_t empty = 0;
+        for (; next_hash < hash_range; next_hash++) {
+          write_verify(&empty, sizeof(size_t), 1, idx_stream);
+        }
+        ok = !any_failed(cursors);
+      }
+
+      // Sizes are patched in once a cell is complete
+      uint64_t num_cells = num_rows * cells_per_row;
+      tmp = num_cells;
+      write_verify(&tmp, sizeof(size_t), 1, idx_stream);
+      Cursors cursors;
+      for (uint64_t r = 0; r < runs.size() && ok; r++) {
+        cursors.emplace_back(new RunCursor(run_files[r]->fp, section_offsets[r], 2 * runs[r].num_points * num_rows));
+      }
+      uint64_t current_cell = 0;
+      size_t size = 0;
+      long size_pos = ftell(idx_stream.fp);
+      write_verify(&size, sizeof(size_t), 1, idx_stream);
+      auto finish_cell = [&]() {
+        if (size > 0) {
+          long end_pos = ftell(idx_stream.fp);
+          fseek(idx_stream.fp, size_pos, SEEK_SET);
+          write_verify(&size, sizeof(size_t), 1, idx_stream);
+          fseek(idx_stream.fp, end_pos, SEEK_SET);
+        }
+      };
+      auto advance_to = [&](uint64_t cell) {
+        for (; current_cell < cell; current_cell++) {
+          finish_cell();
+          size = 0;
+          size_pos = ftell(idx_stream.fp);
+          write_verify(&size, sizeof(size_t), 1, idx_stream);
+        }
+      };
+      merge_memberships(cursors, ok ? num_cells : 0, [&](uint64_t cell, uint64_t point) {
+        advance_to(cell);
+        write_verify(&point, sizeof(uint64_t), 1, idx_stream);
+        size++;
+      });
+      advance_to(num_cells - 1);
+      finish_cell();
+      ok = ok && !any_failed(cursors);
+      cursors.clear();
+      run_files.clear();
+
+      index.write_hash_content_to_index(idx_stream);
+
+      tmp = store ? total_points_added * index.data_dimension : 0;
+      write_verify(&tmp, sizeof(size_t), 1, idx_stream);
+      if (store && ok) {
+        FileIO stored(bases_fname.c_str());
+        std::vector<float> buffer;
+        uint64_t remaining = tmp;
+        ok = stored.fp != NULL;
+        while (remaining > 0 && ok) {
+          buffer.resize(std::min<uint64_t>(remaining, 1 << 16));
+          ok = fread(buffer.data(), sizeof(float), buffer.size(), stored.fp) == buffer.size();
+          write_verify(buffer.data(), sizeof(float), buffer.size(), idx_stream);
+          remaining -= buffer.size();
+        }
+      }
+
+      index.write_additional_content_to_index(idx_stream);
+      index.write_sections_to_index(idx_stream);
+      write_section_header(idx_stream, END_SECTION, 0);
+      ok = ok && fflush(idx_stream.fp) == 0 && !ferror(idx_stream.fp);
+    }
+
+    if (!ok || std::rename(partial_fname.c_str(), fname) != 0) {
+      std::cerr << "Error occurred while writing index file " << fname << std::endl;
+      std::remove(partial_fname.c_str());
+      return;
+    }
+    remove_tmp_files();
+    finished = true;
+  }
+
+  uint64_t StreamingIndexBuilder::num_points_added() const {
+    return total_points_added;
+  }
+
+  void StreamingIndexBuilder::remove_tmp_files() {
+    for (const Run &run: runs) {
+      std::remove(run.fname.c_str());
+    }
+    runs.clear();
+    if (bases_file) {
+      bases_file.reset();
+      std::remove(bases_fname.c_str());
+    }
+  }
+
+}; //end namespace flinng
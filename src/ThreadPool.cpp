@@ -0,0 +1,153 @@
+#include "ThreadPool.h"
+
+namespace flinng {
+
+  static thread_local bool inside_pool_task = false;
+
+  static inline uint64_t pack(uint64_t lo, uint64_t hi) { return lo << 32 | hi; }
+
+  static inline uint64_t range_lo(uint64_t range) { return range >> 32; }
+
+  static inline uint64_t range_hi(uint64_t range) { return range & 0xFFFFFFFF; }
+
+  ThreadPool::ThreadPool(unsigned num_threads, std::function<void(unsigned id)> init)
+      : init(std::move(init)), ranges(new WorkRange[std::max(1u, num_threads)]), size(std::max(1u, num_threads)) {
+    for (unsigned id = 1; id < size; id++) {
+      workers.emplace_back(&ThreadPool::worker_loop, this, id);
+    }
+  }
+
+  ThreadPool::~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker: workers) {
+      worker.join();
+    }
+  }
+
+  unsigned ThreadPool::num_threads() const {
+    return size;
+  }
+
+  void ThreadPool::parallel_for(uint64_t begin, uint64_t end, const std::function<void(uint64_t)> &fn) {
+    if (begin >= end) {
+      return;
+    }
+    // A single task is not worth waking the workers for
+    if (inside_pool_task || size == 1 || end - begin == 1) {
+      for (uint64_t i = begin; i < end; i++) {
+        fn(i);
+      }
+      return;
+    }
+
+    std::lock_guard<std::mutex> job_lock(job_mutex);
+    // Ranges are relative to begin and limited to 32 bits, larger loops are
+    // run as consecutive jobs
+    const uint64_t max_job = 0xFFFFFFFF;
+    for (uint64_t job_begin = begin; job_begin < end; job_begin += max_job) {
+      uint64_t count = std::min(end - job_begin, max_job);
+      for (unsigned id = 0; id < size; id++) {
+        ranges[id].range.store(pack(count * id / size, count * (id + 1) / size));
+      }
+      job_offset = job_begin;
+      remaining.store(count);
+      active.store(size - 1);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        generation++;
+      }
+      wake.notify_all();
+
+      run_tasks(0);
+      // Workers may still be looking for work to steal, fn must outlive them
+      while (remaining.load() != 0 || active.load() != 0) {
+        std::this_thread::yield();
+      }
+      if (failed.load()) {
+        std::exception_ptr first = error;
+        error = nullptr;
+        failed.store(false);
+        std::rethrow_exception(first);
+      }
+    }
+  }
+
+  void ThreadPool::worker_loop(unsigned id) {
+    if (init) {
+      init(id);
+    }
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stopping || generation != seen; });
+        if (stopping) {
+          return;
+        }
+        seen = generation;
+      }
+      run_tasks(id);
+      active.fetch_sub(1);
+    }
+  }
+
+  void ThreadPool::run_tasks(unsigned id) {
+    inside_pool_task = true;
+    uint64_t item;
+    while (remaining.load() != 0) {
+      if (pop(id, item)) {
+        // After a failure the remaining items are only counted down
+        if (!failed.load()) {
+          try {
+            (*job)(job_offset + item);
+          } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!failed.load()) {
+              error = std::current_exception();
+              failed.store(true);
+            }
+          }
+        }
+        remaining.fetch_sub(1);
+      } else if (!steal(id)) {
+        std::this_thread::yield();
+      }
+    }
+    inside_pool_task = false;
+  }
+
+  bool ThreadPool::pop(unsigned id, uint64_t &item) {
+    std::atomic<uint64_t> &own = ranges[id].range;
+    uint64_t range = own.load();
+    while (range_lo(range) < range_hi(range)) {
+      if (own.compare_exchange_weak(range, pack(range_lo(range) + 1, range_hi(range)))) {
+        item = range_lo(range);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool ThreadPool::steal(unsigned thief) {
+    for (unsigned offset = 1; offset < size; offset++) {
+      std::atomic<uint64_t> &victim = ranges[(thief + offset) % size].range;
+      uint64_t range = victim.load();
+      while (range_lo(range) < range_hi(range)) {
+        uint64_t lo = range_lo(range), hi = range_hi(range);
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (victim.compare_exchange_weak(range, pack(lo, mid))) {
+          // Only the owner pushes to its range, and it is empty while stealing
+          ranges[thief].range.store(pack(mid, hi));
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+} //end namespace flinng
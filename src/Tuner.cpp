@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <stdexcept>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "GroundTruth.h"
+#include "Tuner.h"
+
+namespace flinng {
+
+  static double elapsed_seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  void TuningResult::print(std::ostream &out) const {
+    out << std::setw(6) << "rows" << std::setw(10) << "cells" << std::setw(8) << "tables" << std::setw(8)
+        << "hashes" << std::setw(10) << "recall" << std::setw(12) << "sample_qps" << std::setw(12) << "qps"
+        << std::setw(12) << "memory_mb" << std::setw(6) << "goal" << "\n";
+    for (const TuningCandidate &candidate: candidates) {
+      const FlinngBuilder &spec = candidate.spec;
+      out << std::setw(6) << spec.num_rows << std::setw(10) << spec.cells_per_row << std::setw(8)
+          << spec.num_hash_tables << std::setw(8) << spec.hashes_per_table;
+      if (candidate.skipped) {
+        out << std::setw(10) << "-" << std::setw(12) << "-" << std::setw(12) << "-" << std::setw(12) << "skipped"
+            << "\n";
+        continue;
+      }
+      out << std::fixed << std::setw(10) << std::setprecision(4) << candidate.recall << std::setw(12)
+          << std::setprecision(0) << candidate.sample_qps << std::setw(12) << candidate.projected_qps
+          << std::setw(12) << std::setprecision(1) << static_cast<double>(candidate.projected_memory) / (1 << 20)
+          << std::setw(6) << (candidate.meets_goal ? "*" : "") << "\n";
+    }
+    out << (meets_goal ? "Recommended: " : "No candidate meets the goal, closest: ") << "num_rows "
+        << spec.num_rows << ", cells_per_row " << spec.cells_per_row << ", num_hash_tables "
+        << spec.num_hash_tables << ", hashes_per_table " << spec.hashes_per_table << ", sub_hash_bits "
+        << spec.sub_hash_bits << ", calibrate_bins " << spec.calibrate_bins << std::endl;
+  }
+
+  TuningResult tune_parameters(const float *sample, uint64_t num_points, const float *queries,
+                               uint64_t num_queries, uint64_t dimension, const TuningGoal &goal,
+                               const TuningSpace &space) {
+    if (num_points == 0 || num_queries == 0 || goal.k == 0) {
+      throw std::invalid_argument("Tuning needs sample points, queries and k > 0");
+    }
+    uint64_t full_size = goal.full_size == 0 ? num_points : goal.full_size;
+    double scale = static_cast<double>(full_size) / num_points;
+    std::vector<uint64_t> sub_hash_bits = goal.l2 ? space.sub_hash_bits : std::vector<uint64_t>{1};
+
+    // Candidates whose posting list headers alone exceed the limits are never built
+    TuningResult result;
+    for (uint64_t rows: space.num_rows) {
+      for (uint64_t points_per_cell: space.points_per_cell) {
+        for (uint64_t tables: space.num_hash_tables) {
+          for (uint64_t hashes: space.hashes_per_table) {
+            for (uint64_t bits: sub_hash_bits) {
+              TuningCandidate candidate;
+              uint64_t cells = std::max<uint64_t>(1, full_size / std::max<uint64_t>(1, points_per_cell));
+              candidate.spec = FlinngBuilder(rows, cells, tables, hashes, goal.l2 ? bits : 2);
+              candidate.spec.calibrate_bins = goal.l2 && goal.calibrate_bins;
+              uint64_t range_bits = hashes * bits;
+              uint64_t lists = range_bits < 40 ? tables << range_bits : UINT64_MAX;
+              if (range_bits >= 40 || lists > space.max_posting_lists) {
+                candidate.skipped = true;
+                candidate.projected_memory = UINT64_MAX;
+              } else {
+                candidate.projected_memory = lists * sizeof(std::vector<uint32_t>);
+                candidate.skipped = goal.memory_budget > 0 && candidate.projected_memory > goal.memory_budget;
+              }
+              result.candidates.push_back(candidate);
+            }
+          }
+        }
+      }
+    }
+
+    std::vector<uint64_t> ground_truth = brute_force_knn(sample, num_points, queries, num_queries, dimension,
+                                                         goal.k, goal.l2);
+
+    std::vector<TuningCandidate *> to_build;
+    for (TuningCandidate &candidate: result.candidates) {
+      if (!candidate.skipped) {
+        to_build.push_back(&candidate);
+      }
+    }
+    uint64_t batch_size = 1;
+#ifdef _OPENMP
+    batch_size = omp_get_max_threads();
+#endif
+    // Builds one batch at a time so that at most batch_size indexes are alive
+    for (uint64_t first = 0; first < to_build.size(); first += batch_size) {
+      uint64_t batch_end = std::min<uint64_t>(to_build.size(), first + batch_size);
+      std::vector<std::unique_ptr<BaseDenseFlinng32>> indexes(batch_end - first);
+#pragma omp parallel for schedule(dynamic)
+      for (uint64_t i = first; i < batch_end; i++) {
+        // Nested OpenMP regions of the index run on this thread only
+        FlinngBuilder spec = to_build[i]->spec;
+        spec.cells_per_row = std::max<uint64_t>(1, static_cast<uint64_t>(spec.cells_per_row / scale));
+        std::unique_ptr<BaseDenseFlinng32> index;
+        if (goal.l2) {
+          index.reset(new L2DenseFlinng32(dimension, &spec));
+        } else {
+          index.reset(new DenseFlinng32(dimension, &spec));
+        }
+        index->add(const_cast<float *>(sample), num_points);
+        index->finalize_construction();
+        indexes[i - first] = std::move(index);
+      }
+
+      // Timed one at a time so every candidate gets all threads
+      for (uint64_t i = first; i < batch_end; i++) {
+        TuningCandidate &candidate = *to_build[i];
+        BaseDenseFlinng32 &index = *indexes[i - first];
+        float *query_data = const_cast<float *>(queries);
+        auto start = std::chrono::steady_clock::now();
+        index.hashPoints(queries, num_queries);
+        double hash_seconds = elapsed_seconds(start);
+        start = std::chrono::steady_clock::now();
+        std::vector<uint64_t> results = index.query(query_data, num_queries, goal.k);
+        double query_seconds = elapsed_seconds(start);
+
+        // Hashing does not depend on the number of points, the rest of a query does
+        double rest_seconds = std::max(0.0, query_seconds - hash_seconds);
+        candidate.recall = recall_at_k(results, goal.k, ground_truth, goal.k, num_queries, goal.k, goal.k);
+        candidate.sample_qps = num_queries / std::max(query_seconds, 1e-9);
+        candidate.projected_qps = num_queries / std::max(std::min(hash_seconds, query_seconds) + rest_seconds * scale,
+                                                         1e-9);
+
+        MemoryReport report = index.memory_report();
+        candidate.sample_memory = report.total();
+        uint64_t fixed = report.rand_bits.total() + report.posting_lists.overhead + report.stats.total();
+        uint64_t growing = report.posting_lists.reserved + report.cell_membership.total();
+        candidate.projected_memory = fixed + static_cast<uint64_t>(growing * scale);
+        candidate.meets_goal = candidate.recall >= goal.target_recall &&
+                               (goal.memory_budget == 0 || candidate.projected_memory <= goal.memory_budget);
+        indexes[i - first].reset();
+      }
+    }
+
+    // Fastest candidate meeting the goal, else the best recall within
+    // budget, else the smallest
+    const TuningCandidate *best = nullptr;
+    for (const TuningCandidate &candidate: result.candidates) {
+      if (candidate.skipped) {
+        continue;
+      }
+      bool fits = goal.memory_budget == 0 || candidate.projected_memory <= goal.memory_budget;
+      if (best == nullptr) {
+        best = &candidate;
+      } else if (candidate.meets_goal != best->meets_goal) {
+        best = candidate.meets_goal ? &candidate : best;
+      } else if (candidate.meets_goal) {
+        best = candidate.projected_qps > best->projected_qps ? &candidate : best;
+      } else {
+        bool best_fits = goal.memory_budget == 0 || best->projected_memory <= goal.memory_budget;
+        if (fits != best_fits) {
+          best = fits ? &candidate : best;
+        } else if (fits) {
+          best = candidate.recall > best->recall ? &candidate : best;
+        } else {
+          best = candidate.projected_memory < best->projected_memory ? &candidate : best;
+        }
+      }
+    }
+    if (best != nullptr) {
+      result.spec = best->spec;
+      result.meets_goal = best->meets_goal;
+    } else {
+      // Nothing could be built
+      result.spec = result.candidates.empty() ? FlinngBuilder() : result.candidates.front().spec;
+    }
+    return result;
+  }
+
+} //end namespace flinng
@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include "io.h"
 
 flinng::FileIO::FileIO(const char *fname, bool write)
@@ -9,3 +12,110 @@ flinng::FileIO::~FileIO() {
     fclose(fp);
   }
 }
+
+flinng::VectorFileReader::VectorFileReader(const char *fname, VectorFormat format, uint64_t dimension)
+    : file(fname), format(format), dim(dimension) {
+  if (file.fp == nullptr || format == VectorFormat::float32) {
+    return;
+  }
+  // The dimension is the header of the first vector
+  int32_t header = 0;
+  if (fread(&header, sizeof(header), 1, file.fp) == 1) {
+    dim = header;
+  }
+  rewind(file.fp);
+}
+
+bool flinng::VectorFileReader::good() const {
+  return file.fp != nullptr && dim > 0;
+}
+
+uint64_t flinng::VectorFileReader::dimension() const {
+  return dim;
+}
+
+uint64_t flinng::VectorFileReader::read(std::vector<float> &chunk, uint64_t max_points) {
+  chunk.resize(max_points * dim);
+  if (!good()) {
+    chunk.clear();
+    return 0;
+  }
+
+  uint64_t num_read = 0;
+  if (format == VectorFormat::float32) {
+    num_read = fread(chunk.data(), sizeof(float) * dim, max_points, file.fp);
+  } else {
+    std::vector<uint8_t> bytes(format == VectorFormat::bvecs ? dim : 0);
+    int32_t header;
+    for (; num_read < max_points; num_read++) {
+      if (fread(&header, sizeof(header), 1, file.fp) != 1) {
+        break;
+      }
+      if (static_cast<uint64_t>(header) != dim) {
+        std::cerr << "Vector " << num_read << " of chunk in " << file.fname << " has dimension " << header
+                  << ", expected " << dim << std::endl;
+        break;
+      }
+      float *vec = chunk.data() + num_read * dim;
+      if (format == VectorFormat::fvecs) {
+        if (fread(vec, sizeof(float), dim, file.fp) != dim) {
+          break;
+        }
+      } else {
+        if (fread(bytes.data(), sizeof(uint8_t), dim, file.fp) != dim) {
+          break;
+        }
+        std::copy(bytes.begin(), bytes.end(), vec);
+      }
+    }
+  }
+
+  chunk.resize(num_read * dim);
+  return num_read;
+}
+
+bool flinng::read_ivecs(const char *fname, std::vector<int32_t> &values, uint64_t &dimension) {
+  FileIO file(fname);
+  values.clear();
+  dimension = 0;
+  if (file.fp == nullptr) {
+    return false;
+  }
+
+  int32_t header;
+  while (fread(&header, sizeof(header), 1, file.fp) == 1) {
+    if (dimension == 0) {
+      dimension = header;
+    } else if (static_cast<uint64_t>(header) != dimension) {
+      std::cerr << "Inconsistent dimension " << header << " in " << fname << std::endl;
+      return false;
+    }
+    values.resize(values.size() + dimension);
+    if (fread(values.data() + values.size() - dimension, sizeof(int32_t), dimension, file.fp) != dimension) {
+      std::cerr << "Truncated vector in " << fname << std::endl;
+      return false;
+    }
+  }
+  return dimension > 0;
+}
+
+bool flinng::read_sparse_vectors(const char *fname, std::vector<std::vector<uint64_t>> &points) {
+  std::ifstream in(fname);
+  points.clear();
+  if (!in) {
+    return false;
+  }
+
+  std::string line, entry;
+  while (std::getline(in, line)) {
+    std::stringstream ss(line);
+    std::vector<uint64_t> point;
+    while (ss >> entry) {
+      point.push_back(std::stoull(entry.substr(0, entry.find(':'))));
+    }
+    if (!point.empty()) {
+      points.push_back(point);
+    }
+  }
+  return true;
+}
@@ -1,3 +1,6 @@
+#include <limits>
+#include <thread>
+#include <typeinfo>
 #include "lib_flinng.h"
 
 static uint64_t power(const uint64_t base, const uint64_t exp) {
@@ -9,6 +12,10 @@ static uint64_t power(const uint64_t base, const uint64_t exp) {
 }
 
 namespace flinng {
+  // Set for the workers of a numa_pool, see BaseDenseFlinng32::local_replica
+  static thread_local const BaseDenseFlinng32 *numa_worker_index = nullptr;
+  static thread_local uint64_t numa_worker_replica = 0;
+
   void write_verify(void *ptr, size_t size, size_t count, FileIO &file) {
     size_t ret = fwrite(ptr, size, count, file.fp);
     if (ret != count) {
@@ -27,6 +34,22 @@ namespace flinng {
     }
   }
 
+  void write_section_header(FileIO &file, uint32_t tag, uint64_t size) {
+    write_verify(&tag, sizeof(tag), 1, file);
+    write_verify(&size, sizeof(size), 1, file);
+  }
+
+  void read_sections(FileIO &file, const std::function<bool(uint32_t tag, uint64_t size)> &read) {
+    uint32_t tag;
+    uint64_t size;
+    while (fread(&tag, sizeof(tag), 1, file.fp) == 1 && tag != END_SECTION) {
+      read_verify(&size, sizeof(size), 1, file);
+      if (!read(tag, size)) {
+        fseek(file.fp, size, SEEK_CUR);
+      }
+    }
+  }
+
   BaseDenseFlinng32::BaseDenseFlinng32(uint64_t num_rows, uint64_t cells_per_row, uint64_t data_dimension,
                                        uint64_t num_hash_tables,
                                        uint64_t hashes_per_table, uint64_t hash_range)
@@ -52,16 +75,25 @@ namespace flinng {
                                   ", and there must be at least 1 row.");
     }
     uint64_t num_points = points.size() / data_dimension;
-    std::vector<uint64_t> hashes = getHashes(points.data(), num_points);
-    internal_flinng.addPoints(hashes);
+    addPoints(const_cast<float *>(points.data()), num_points);
   }
 
   void BaseDenseFlinng32::addPoints(float *points, uint64_t num_points) {
-    std::vector<uint64_t> hashes = getHashes(points, num_points);
+    if (internal_flinng.num_points_added() == 0) {
+      calibrate_hashes(points, num_points);
+    }
+    std::vector<uint64_t> hashes = hashPoints(points, num_points);
     internal_flinng.addPoints(hashes);
+    // Stale replicas are dropped until the next prepareForQueries
+    numa_replicas.clear();
   }
 
-  void BaseDenseFlinng32::prepareForQueries() { internal_flinng.prepareForQueries(); }
+  void BaseDenseFlinng32::prepareForQueries() {
+    internal_flinng.prepareForQueries();
+    if (numa_enabled) {
+      build_numa_replicas();
+    }
+  }
 
   std::vector<uint64_t> BaseDenseFlinng32::query(const std::vector<float> &queries, uint32_t top_k) {
     if (queries.size() < data_dimension || queries.size() % data_dimension != 0) {
@@ -70,14 +102,57 @@ namespace flinng {
                                   ", and there must be at least 1 row.");
     }
     uint64_t num_queries = queries.size() / data_dimension;
-    std::vector<uint64_t> hashes = getHashes(queries.data(), num_queries);
-    std::vector<uint64_t> results = internal_flinng.query(hashes, top_k);
-    return results;
+    return query(const_cast<float *>(queries.data()), num_queries, top_k);
   }
 
   std::vector<uint64_t> BaseDenseFlinng32::query(float *queries, uint64_t num_queries, uint32_t top_k) {
-    std::vector<uint64_t> hashes = getHashes(queries, num_queries);
-    std::vector<uint64_t> results = internal_flinng.query(hashes, top_k);
+    return query_with_stats(queries, num_queries, top_k, nullptr);
+  }
+
+  std::vector<uint64_t> BaseDenseFlinng32::query(float *queries, uint64_t num_queries, uint32_t top_k,
+                                                 std::vector<QueryStats> &stats) {
+    stats.assign(num_queries, QueryStats());
+    return query_with_stats(queries, num_queries, top_k, stats.data());
+  }
+
+  std::vector<uint64_t> BaseDenseFlinng32::query(float *queries, uint64_t num_queries, uint32_t top_k,
+                                                 const QueryOptions &options) {
+    return query_with_stats(queries, num_queries, top_k, nullptr, &options);
+  }
+
+  std::vector<uint64_t> BaseDenseFlinng32::query_with_stats(float *queries, uint64_t num_queries, uint32_t top_k,
+                                                            QueryStats *stats, const QueryOptions *options) {
+#ifdef FLINNG_ENABLE_STATS
+    // Hashing times reach the index aggregate through the per query stats
+    std::vector<QueryStats> local_stats;
+    if (stats == nullptr) {
+      local_stats.resize(num_queries);
+      stats = local_stats.data();
+    }
+#endif
+    const uint64_t num_probes = Flinng::probes_per_table(options);
+    ThreadPool *pool = query_pool();
+    if (pool != nullptr || options != nullptr) {
+      // Hashing and ranking are pipelined per query
+      std::vector<uint64_t> results(num_queries * top_k);
+      parallel_for(pool, num_queries, [&](uint64_t i) {
+        const float *query = queries + i * data_dimension;
+        // Replicas share the aggregate statistics of internal_flinng
+        const NumaReplica *replica = local_replica();
+        const Flinng &flinng = replica == nullptr ? internal_flinng : *replica->flinng;
+        flinng.query_one_lazy([&](uint64_t first_table, uint64_t num_tables, uint64_t *hashes) {
+          hashPoint(query, hashes, first_table, num_tables, num_probes);
+          add_split_bits(query, hashes, first_table, num_tables, num_probes);
+        }, top_k, results.data() + i * top_k, nullptr, stats == nullptr ? nullptr : stats + i, options);
+      });
+      return results;
+    }
+    FLINNG_STATS(auto hash_start = std::chrono::steady_clock::now());
+    std::vector<uint64_t> hashes = getQueryHashes(queries, num_queries);
+    // Batch hashing time is split evenly over the queries
+    FLINNG_STATS(uint64_t hash_ns = elapsed_ns(hash_start) / num_queries;
+                 for (uint64_t i = 0; i < num_queries; i++) stats[i].hash_ns = hash_ns);
+    std::vector<uint64_t> results = internal_flinng.query(hashes, top_k, stats, options);
     return results;
   }
 
@@ -104,8 +179,13 @@ namespace flinng {
     std::copy(results.begin(), results.end(), ids);
   }
 
+  void BaseDenseFlinng32::search(float *queries, unsigned n, unsigned k, long *ids, const QueryOptions &options) {
+    std::vector<uint64_t> results = query(queries, n, k, options);
+    std::copy(results.begin(), results.end(), ids);
+  }
+
   void BaseDenseFlinng32::search_with_distance(float *queries, unsigned n, unsigned k, long *ids, float *distances) {
-    if (bases.size() / data_dimension != internal_flinng.num_points_added()) {
+    if (!stores_dataset()) {
       std::cerr << "Dataset is not stored! Distance cannot be calculated. Invoke add_with_store() to store dataset."
                 << std::endl;
       return;
@@ -113,12 +193,291 @@ namespace flinng {
 
     search(queries, n, k, ids);
 
-#pragma omp parallel for
-    for (unsigned i = 0; i < n; i++) {
+    parallel_for(query_pool(), n, [&](uint64_t i) {
+      NumaReplica *replica = local_replica();
+      float *stored = replica == nullptr ? bases.data() : replica->bases.data();
       for (unsigned j = 0; j < k; j++) {
-        distances[i * k + j] = compute_distance(queries + data_dimension * i,
-                                                bases.data() + data_dimension * ids[i * k + j]);
+        distances[i * k + j] = ids[i * k + j] < 0 ? std::numeric_limits<float>::max()
+                                                  : compute_distance(queries + data_dimension * i,
+                                                                     stored + data_dimension * ids[i * k + j]);
+      }
+    });
+  }
+
+  bool BaseDenseFlinng32::has_same_hashes(const BaseDenseFlinng32 &other) const {
+    return typeid(*this) == typeid(other) && data_dimension == other.data_dimension &&
+           num_hash_tables == other.num_hash_tables && hashes_per_table == other.hashes_per_table &&
+           rand_bits == other.rand_bits;
+  }
+
+  bool L2DenseFlinng32::has_same_hashes(const BaseDenseFlinng32 &other) const {
+    const L2DenseFlinng32 &l2_other = static_cast<const L2DenseFlinng32 &>(other);
+    return BaseDenseFlinng32::has_same_hashes(other) && sub_hash_bits == l2_other.sub_hash_bits &&
+           cutoff == l2_other.cutoff && bin_offsets == l2_other.bin_offsets && bin_widths == l2_other.bin_widths;
+  }
+
+  void L2DenseFlinng32::calibrate(const float *sample, uint64_t num_points) {
+    if (internal_flinng.num_points_added() != 0) {
+      throw std::invalid_argument("Only an empty index can be calibrated, its points were hashed with other bins.");
+    }
+    if (num_points < min_calibration_points) {
+      throw std::invalid_argument("Calibration needs at least " + std::to_string(min_calibration_points) +
+                                  " sample points.");
+    }
+    // A strided sample of the first add bounds the calibration cost
+    const uint64_t max_sample = 1 << 14;
+    std::vector<float> strided;
+    if (num_points > max_sample) {
+      strided.resize(max_sample * data_dimension);
+      for (uint64_t i = 0; i < max_sample; i++) {
+        const float *point = sample + i * num_points / max_sample * data_dimension;
+        std::copy(point, point + data_dimension, strided.begin() + i * data_dimension);
       }
+      sample = strided.data();
+      num_points = max_sample;
+    }
+    calibrate_l2_bins(sample, num_points, data_dimension, rand_bits.data(), num_hash_tables, hashes_per_table,
+                      sub_hash_bits, bin_offsets, bin_widths);
+    numa_replicas.clear();
+  }
+
+  bool L2DenseFlinng32::is_calibrated() const {
+    return !bin_offsets.empty();
+  }
+
+  void L2DenseFlinng32::calibrate_hashes(const float *sample, uint64_t num_points) {
+    // Later points must be hashed like these, so too small a first add
+    // keeps the fixed bins for good, see calibration_skipped
+    if (!calibrate_bins || is_calibrated() || num_points < min_calibration_points) {
+      return;
+    }
+    calibrate(sample, num_points);
+  }
+
+  bool L2DenseFlinng32::calibration_skipped() const {
+    return calibrate_bins && !is_calibrated() && internal_flinng.num_points_added() != 0;
+  }
+
+  void BaseDenseFlinng32::merge(const BaseDenseFlinng32 &other) {
+    if (!has_same_hashes(other)) {
+      throw std::invalid_argument("Only indexes of the same type with identical hash parameters "
+                                  "and rand_bits can be merged.");
+    }
+    bool stored = stores_dataset();
+    bool other_stored = other.stores_dataset();
+    if (stored != other_stored) {
+      throw std::invalid_argument("Either both or neither of the merged indexes must store their dataset.");
+    }
+
+    internal_flinng.merge(other.internal_flinng);
+    bases.insert(bases.end(), other.bases.begin(), other.bases.end());
+    numa_replicas.clear();
+  }
+
+  void BaseDenseFlinng32::set_labels(uint64_t first_point, const uint32_t *labels, uint64_t num_points) {
+    internal_flinng.set_labels(first_point, labels, num_points);
+    // Stale replicas are dropped until the next prepareForQueries
+    numa_replicas.clear();
+  }
+
+  uint32_t BaseDenseFlinng32::label(uint64_t point) const {
+    return internal_flinng.label(point);
+  }
+
+  void BaseDenseFlinng32::enable_numa_replication() {
+    std::vector<NumaNode> nodes = numa_topology();
+    if (nodes.size() < 2) {
+      return;
+    }
+    enable_numa_replication(nodes);
+  }
+
+  void BaseDenseFlinng32::enable_numa_replication(const std::vector<NumaNode> &nodes) {
+    numa_enabled = true;
+    numa_nodes = nodes;
+    // Worker i serves the node holding the i-th of all cpus, the calling
+    // thread takes the place of the first
+    std::vector<uint64_t> worker_replicas;
+    for (uint64_t i = 0; i < nodes.size(); i++) {
+      worker_replicas.insert(worker_replicas.end(), nodes[i].cpus.size(), i);
+    }
+    numa_pool.reset(new ThreadPool(worker_replicas.size(), [this, nodes, worker_replicas](unsigned id) {
+      pin_thread_to_node(nodes[worker_replicas[id]]);
+      numa_worker_index = this;
+      numa_worker_replica = worker_replicas[id];
+    }));
+    build_numa_replicas();
+  }
+
+  void BaseDenseFlinng32::disable_numa_replication() {
+    numa_enabled = false;
+    numa_nodes.clear();
+    numa_replicas.clear();
+    numa_pool.reset();
+  }
+
+  ThreadPool *BaseDenseFlinng32::query_pool() const {
+    return numa_replicas.empty() ? thread_pool.get() : numa_pool.get();
+  }
+
+  BaseDenseFlinng32::NumaReplica *BaseDenseFlinng32::local_replica() {
+    if (numa_worker_index != this || numa_worker_replica >= numa_replicas.size()) {
+      return nullptr;
+    }
+    return &numa_replicas[numa_worker_replica];
+  }
+
+  void BaseDenseFlinng32::set_num_threads(unsigned num_threads) {
+    thread_pool.reset(num_threads == 0 ? nullptr : new ThreadPool(num_threads));
+    internal_flinng.set_thread_pool(thread_pool);
+  }
+
+  MemoryReport BaseDenseFlinng32::memory_report() const {
+    MemoryReport report = internal_flinng.memory_report();
+    report.rand_bits = vector_memory(rand_bits);
+    report.rand_bits += vector_memory(split_rand_bits);
+    report.bases = vector_memory(bases);
+    for (const NumaReplica &replica: numa_replicas) {
+      MemoryReport replica_report = replica.flinng->memory_report();
+      report.numa_replicas += replica_report.posting_lists;
+      report.numa_replicas += replica_report.cell_membership;
+      report.numa_replicas += replica_report.labels;
+      report.numa_replicas += vector_memory(replica.bases);
+    }
+    return report;
+  }
+
+  void BaseDenseFlinng32::compact() {
+    internal_flinng.compact();
+    shrink_vector(rand_bits);
+    shrink_vector(split_rand_bits);
+    shrink_vector(bases);
+  }
+
+  void BaseDenseFlinng32::balance_buckets(const BucketBalance &balance) {
+    if (balance.policy == BucketPolicy::split && !stores_dataset()) {
+      throw std::invalid_argument("Splitting buckets rehashes the dataset, which must be stored with add_and_store.");
+    }
+    internal_flinng.set_bucket_balance(balance);
+    split_rand_bits.clear();
+    if (balance.policy == BucketPolicy::split) {
+      split_rand_bits.resize(num_hash_tables * balance.split_bits * data_dimension);
+      for (uint64_t i = 0; i < split_rand_bits.size(); i++) {
+        split_rand_bits[i] = (rand() % 2) * 2 - 1;
+      }
+      internal_flinng.split_oversized_buckets([&](uint64_t first_point, uint64_t num_points, uint64_t *hashes) {
+        const float *points = bases.data() + first_point * data_dimension;
+        std::vector<uint64_t> base_hashes = hashPoints(points, num_points);
+        parallel_for(thread_pool.get(), num_points, [&](uint64_t i) {
+          for (uint64_t table = 0; table < num_hash_tables; table++) {
+            hashes[i * num_hash_tables + table] = internal_flinng.split_hash(
+                base_hashes[i * num_hash_tables + table], split_extra(points + i * data_dimension, table));
+          }
+        });
+      });
+    }
+    numa_replicas.clear();
+    if (numa_enabled) {
+      build_numa_replicas();
+    }
+  }
+
+  const BucketStats &BaseDenseFlinng32::bucket_stats() const {
+    return internal_flinng.bucket_stats();
+  }
+
+  void BaseDenseFlinng32::store_signatures(bool store) {
+    internal_flinng.store_signatures(store);
+  }
+
+  bool BaseDenseFlinng32::stores_signatures() const {
+    return internal_flinng.stores_signatures();
+  }
+
+  void BaseDenseFlinng32::regroup(uint64_t num_rows, uint64_t cells_per_row) {
+    internal_flinng.regroup(num_rows, cells_per_row);
+    numa_replicas.clear();
+    if (numa_enabled) {
+      build_numa_replicas();
+    }
+  }
+
+  uint64_t BaseDenseFlinng32::split_extra(const float *point, uint64_t table) const {
+    const uint64_t split_bits = internal_flinng.bucket_balance().split_bits;
+    const int8_t *bits = split_rand_bits.data() + table * split_bits * data_dimension;
+    uint64_t extra = 0;
+    for (uint64_t bit = 0; bit < split_bits; bit++) {
+      float projection = 0;
+      for (uint64_t d = 0; d < data_dimension; d++) {
+        projection += bits[bit * data_dimension + d] * point[d];
+      }
+      extra = extra << 1 | (projection > 0);
+    }
+    return extra;
+  }
+
+  void BaseDenseFlinng32::add_split_bits(const float *point, uint64_t *hashes, uint64_t first_table,
+                                         uint64_t num_tables, uint64_t num_probes) const {
+    if (!internal_flinng.has_split_buckets()) {
+      return;
+    }
+    for (uint64_t table = 0; table < num_tables; table++) {
+      uint64_t *probes = hashes + table * num_probes;
+      // The extra bits do not depend on the probe, so they are derived once
+      int64_t extra = -1;
+      for (uint64_t probe = 0; probe < num_probes; probe++) {
+        if (probes[probe] == no_probe || !internal_flinng.is_split(first_table + table, probes[probe])) {
+          continue;
+        }
+        if (extra < 0) {
+          extra = split_extra(point, first_table + table);
+        }
+        probes[probe] = internal_flinng.split_hash(probes[probe], extra);
+      }
+    }
+  }
+
+  std::vector<uint64_t> BaseDenseFlinng32::getQueryHashes(const float *points, uint64_t num_points) {
+    std::vector<uint64_t> hashes = hashPoints(points, num_points);
+    if (internal_flinng.has_split_buckets()) {
+      parallel_for(thread_pool.get(), num_points, [&](uint64_t i) {
+        add_split_bits(points + i * data_dimension, hashes.data() + i * num_hash_tables, 0, num_hash_tables, 1);
+      });
+    }
+    return hashes;
+  }
+
+  const IndexStats *BaseDenseFlinng32::query_stats() const {
+    return internal_flinng.query_stats();
+  }
+
+  void BaseDenseFlinng32::reset_query_stats() {
+    internal_flinng.reset_query_stats();
+  }
+
+  std::vector<HotBucket> BaseDenseFlinng32::hot_buckets(uint64_t count) const {
+    return internal_flinng.hot_buckets(count);
+  }
+
+  void BaseDenseFlinng32::build_numa_replicas() {
+    numa_replicas.clear();
+
+    // Each replica is copied by a thread pinned to its node so that first
+    // touch places it in node-local memory
+    numa_replicas.resize(numa_nodes.size());
+    std::vector<std::thread> workers;
+    for (uint64_t i = 0; i < numa_nodes.size(); i++) {
+      workers.emplace_back([this, i]() {
+        NumaReplica &replica = numa_replicas[i];
+        replica.node = numa_nodes[i];
+        pin_thread_to_node(replica.node);
+        replica.flinng.reset(new Flinng(internal_flinng));
+        replica.flinng->set_thread_pool(nullptr);
+        replica.bases = bases;
+      });
+    }
+    for (std::thread &worker: workers) {
+      worker.join();
     }
   }
 
@@ -149,6 +508,29 @@ namespace flinng {
     std::copy(bases.begin() + id * data_dimension, bases.begin() + (id + 1) * data_dimension, desc);
   }
 
+  std::vector<uint64_t> BaseDenseFlinng32::hashPoints(const float *points, uint64_t num_points) {
+    if (!thread_pool) {
+      return getHashes(points, num_points);
+    }
+    std::vector<uint64_t> hashes(num_points * num_hash_tables);
+    thread_pool->parallel_for(0, num_points, [&](uint64_t i) {
+      hashPoint(points + i * data_dimension, hashes.data() + i * num_hash_tables, 0, num_hash_tables, 1);
+    });
+    return hashes;
+  }
+
+  uint64_t BaseDenseFlinng32::num_points_added() const {
+    return internal_flinng.num_points_added();
+  }
+
+  uint64_t BaseDenseFlinng32::dimension() const {
+    return data_dimension;
+  }
+
+  bool BaseDenseFlinng32::stores_dataset() const {
+    return bases.size() / data_dimension == internal_flinng.num_points_added();
+  }
+
   BaseDenseFlinng32 * BaseDenseFlinng32::from_index(const char *fname) {
     FileIO idx_stream(fname);
     if (idx_stream.fp == NULL) {
@@ -165,13 +547,23 @@ namespace flinng {
     }
     obj->read_content_from_index(idx_stream);
     obj->read_additional_content_from_index(idx_stream);
+    read_sections(idx_stream, [&](uint32_t tag, uint64_t size) {
+      return obj->read_section_from_index(idx_stream, tag, size);
+    });
 
     return obj;
   }
 
   void BaseDenseFlinng32::write_content_to_index(FileIO &index) {
     internal_flinng.write_content_to_index(index);
+    write_hash_content_to_index(index);
 
+    size_t tmp = bases.size();
+    write_verify(&tmp, sizeof(size_t), 1, index);
+    write_verify(bases.data(), sizeof(float), bases.size(), index);
+  }
+
+  void BaseDenseFlinng32::write_hash_content_to_index(FileIO &index) {
     write_verify(&num_hash_tables, sizeof(num_hash_tables), 1, index);
     write_verify(&hashes_per_table, sizeof(hashes_per_table), 1, index);
     write_verify(&data_dimension, sizeof(data_dimension), 1, index);
@@ -179,10 +571,6 @@ namespace flinng {
     size_t tmp = rand_bits.size();
     write_verify(&tmp, sizeof(size_t), 1, index);
     write_verify(rand_bits.data(), sizeof(int8_t), rand_bits.size(), index);
-
-    tmp = bases.size();
-    write_verify(&tmp, sizeof(size_t), 1, index);
-    write_verify(bases.data(), sizeof(float), bases.size(), index);
   }
 
   void BaseDenseFlinng32::read_content_from_index(FileIO &index) {
@@ -213,6 +601,25 @@ namespace flinng {
     write_type_to_index(idx_stream);
     write_content_to_index(idx_stream);
     write_additional_content_to_index(idx_stream);
+    write_sections_to_index(idx_stream);
+    write_section_header(idx_stream, END_SECTION, 0);
+  }
+
+  void BaseDenseFlinng32::write_sections_to_index(FileIO &index) {
+    internal_flinng.write_sections_to_index(index);
+    if (!split_rand_bits.empty()) {
+      write_section_header(index, SPLIT_PROJECTIONS_SECTION, split_rand_bits.size());
+      write_verify(split_rand_bits.data(), sizeof(int8_t), split_rand_bits.size(), index);
+    }
+  }
+
+  bool BaseDenseFlinng32::read_section_from_index(FileIO &index, uint32_t tag, uint64_t size) {
+    if (tag == SPLIT_PROJECTIONS_SECTION) {
+      split_rand_bits.resize(size);
+      read_verify(split_rand_bits.data(), sizeof(int8_t), size, index);
+      return true;
+    }
+    return internal_flinng.read_section_from_index(index, tag, size);
   }
 
   bool BaseDenseFlinng32::read_type_from_index(FileIO &index) {
@@ -256,14 +663,15 @@ namespace flinng {
 
   L2DenseFlinng32::L2DenseFlinng32(uint64_t num_rows, uint64_t cells_per_row,
                                    uint64_t data_dimension, uint64_t num_hash_tables,
-                                   uint64_t hashes_per_table, uint64_t sub_hash_bits, uint64_t cutoff)
+                                   uint64_t hashes_per_table, uint64_t sub_hash_bits, uint64_t cutoff,
+                                   bool calibrate_bins)
       : BaseDenseFlinng32(num_rows, cells_per_row, data_dimension, num_hash_tables, hashes_per_table,
                           power(1 << sub_hash_bits, hashes_per_table)),
-        sub_hash_bits(sub_hash_bits), cutoff(cutoff) {}
+        sub_hash_bits(sub_hash_bits), cutoff(cutoff), calibrate_bins(calibrate_bins) {}
 
   L2DenseFlinng32::L2DenseFlinng32(uint64_t data_dimension, FlinngBuilder &&def)
       : L2DenseFlinng32(def.num_rows, def.cells_per_row, data_dimension, def.num_hash_tables, def.hashes_per_table,
-                        def.sub_hash_bits, def.cut_off) {}
+                        def.sub_hash_bits, def.cut_off, def.calibrate_bins) {}
 
   L2DenseFlinng32::L2DenseFlinng32(uint64_t data_dimension, FlinngBuilder *def)
       : L2DenseFlinng32(data_dimension, def == nullptr ? FlinngBuilder() : *def) {}
@@ -279,6 +687,32 @@ namespace flinng {
   void L2DenseFlinng32::read_additional_content_from_index(FileIO &index) {
     read_verify(&sub_hash_bits, sizeof(sub_hash_bits), 1, index);
     read_verify(&cutoff, sizeof(cutoff), 1, index);
+    // Indexes written before calibration existed keep their fixed bins, the
+    // calibration section turns it back on
+    calibrate_bins = false;
+  }
+
+  void L2DenseFlinng32::write_sections_to_index(FileIO &index) {
+    BaseDenseFlinng32::write_sections_to_index(index);
+    // Whether to calibrate, then the offsets and widths if calibrated
+    uint64_t num_bins = bin_offsets.size();
+    write_section_header(index, L2_CALIBRATION_SECTION, sizeof(bool) + 2 * num_bins * sizeof(float));
+    write_verify(&calibrate_bins, sizeof(bool), 1, index);
+    write_verify(bin_offsets.data(), sizeof(float), num_bins, index);
+    write_verify(bin_widths.data(), sizeof(float), num_bins, index);
+  }
+
+  bool L2DenseFlinng32::read_section_from_index(FileIO &index, uint32_t tag, uint64_t size) {
+    if (tag != L2_CALIBRATION_SECTION) {
+      return BaseDenseFlinng32::read_section_from_index(index, tag, size);
+    }
+    uint64_t num_bins = (size - sizeof(bool)) / (2 * sizeof(float));
+    read_verify(&calibrate_bins, sizeof(bool), 1, index);
+    bin_offsets.resize(num_bins);
+    bin_widths.resize(num_bins);
+    read_verify(bin_offsets.data(), sizeof(float), num_bins, index);
+    read_verify(bin_widths.data(), sizeof(float), num_bins, index);
+    return true;
   }
 
 //todo add new APIs for SparseFlinng 
@@ -291,6 +725,77 @@ namespace flinng {
         num_hash_tables(num_hash_tables), hashes_per_table(hashes_per_table),
         hash_range_pow(hash_range_pow), seed(rand()) {}
 
+  SparseFlinng32::SparseFlinng32(uint64_t num_rows, uint64_t cells_per_row,
+                                 uint64_t num_hash_tables, uint64_t hashes_per_table,
+                                 uint64_t hash_range_pow, uint32_t seed)
+      : internal_flinng(num_rows, cells_per_row, num_hash_tables,
+                        1 << hash_range_pow),
+        num_hash_tables(num_hash_tables), hashes_per_table(hashes_per_table),
+        hash_range_pow(hash_range_pow), seed(seed) {}
+
+  SparseFlinng32 *SparseFlinng32::from_index(const char *fname) {
+    FileIO idx_stream(fname);
+    if (idx_stream.fp == NULL) {
+      std::cerr << "Error occurred while opening index file for reading" << std::endl;
+      return nullptr;
+    }
+
+    uint64_t num_hash_tables, hashes_per_table, hash_range_pow;
+    uint32_t seed;
+    read_verify(&num_hash_tables, sizeof(num_hash_tables), 1, idx_stream);
+    read_verify(&hashes_per_table, sizeof(hashes_per_table), 1, idx_stream);
+    read_verify(&hash_range_pow, sizeof(hash_range_pow), 1, idx_stream);
+    read_verify(&seed, sizeof(seed), 1, idx_stream);
+
+    SparseFlinng32 *obj = new SparseFlinng32(0, 0, num_hash_tables, hashes_per_table, hash_range_pow, seed);
+    obj->internal_flinng.read_content_from_index(idx_stream);
+    read_sections(idx_stream, [&](uint32_t tag, uint64_t size) {
+      return obj->internal_flinng.read_section_from_index(idx_stream, tag, size);
+    });
+
+    return obj;
+  }
+
+  void SparseFlinng32::write_index(const char *fname) {
+    FileIO idx_stream(fname, true);
+    if (idx_stream.fp == NULL) {
+      std::cerr << "Error occurred while opening index file for writing" << std::endl;
+      return;
+    }
+
+    uint64_t tmp = num_hash_tables;
+    write_verify(&tmp, sizeof(tmp), 1, idx_stream);
+    tmp = hashes_per_table;
+    write_verify(&tmp, sizeof(tmp), 1, idx_stream);
+    tmp = hash_range_pow;
+    write_verify(&tmp, sizeof(tmp), 1, idx_stream);
+    uint32_t tmp_seed = seed;
+    write_verify(&tmp_seed, sizeof(tmp_seed), 1, idx_stream);
+    internal_flinng.write_content_to_index(idx_stream);
+    internal_flinng.write_sections_to_index(idx_stream);
+    write_section_header(idx_stream, END_SECTION, 0);
+  }
+
+  uint64_t SparseFlinng32::num_points_added() const {
+    return internal_flinng.num_points_added();
+  }
+
+  void SparseFlinng32::merge(const SparseFlinng32 &other) {
+    if (seed != other.seed || num_hash_tables != other.num_hash_tables ||
+        hashes_per_table != other.hashes_per_table || hash_range_pow != other.hash_range_pow) {
+      throw std::invalid_argument("Only indexes with the same seed and hash parameters can be merged.");
+    }
+    internal_flinng.merge(other.internal_flinng);
+  }
+
+  void SparseFlinng32::set_labels(uint64_t first_point, const uint32_t *labels, uint64_t num_points) {
+    internal_flinng.set_labels(first_point, labels, num_points);
+  }
+
+  uint32_t SparseFlinng32::label(uint64_t point) const {
+    return internal_flinng.label(point);
+  }
+
   void SparseFlinng32::addPointsSameDim(const uint64_t *points, uint64_t num_points, uint64_t point_dimension) {
     std::vector<uint64_t> hashes = getHashes(points, num_points, point_dimension);
     internal_flinng.addPoints(hashes);
@@ -313,16 +818,101 @@ namespace flinng {
 
   void SparseFlinng32::prepareForQueries() { internal_flinng.prepareForQueries(); }
 
+  void SparseFlinng32::set_num_threads(unsigned num_threads) {
+    thread_pool.reset(num_threads == 0 ? nullptr : new ThreadPool(num_threads));
+    internal_flinng.set_thread_pool(thread_pool);
+  }
+
+  MemoryReport SparseFlinng32::memory_report() const {
+    return internal_flinng.memory_report();
+  }
+
+  void SparseFlinng32::compact() {
+    internal_flinng.compact();
+  }
+
+  void SparseFlinng32::balance_buckets(const BucketBalance &balance) {
+    if (balance.policy == BucketPolicy::split) {
+      throw std::invalid_argument("Only dense indexes can split buckets.");
+    }
+    internal_flinng.set_bucket_balance(balance);
+  }
+
+  const BucketStats &SparseFlinng32::bucket_stats() const {
+    return internal_flinng.bucket_stats();
+  }
+
+  void SparseFlinng32::store_signatures(bool store) {
+    internal_flinng.store_signatures(store);
+  }
+
+  bool SparseFlinng32::stores_signatures() const {
+    return internal_flinng.stores_signatures();
+  }
+
+  void SparseFlinng32::regroup(uint64_t num_rows, uint64_t cells_per_row) {
+    internal_flinng.regroup(num_rows, cells_per_row);
+  }
+
+  const IndexStats *SparseFlinng32::query_stats() const {
+    return internal_flinng.query_stats();
+  }
+
+  void SparseFlinng32::reset_query_stats() {
+    internal_flinng.reset_query_stats();
+  }
+
+  std::vector<HotBucket> SparseFlinng32::hot_buckets(uint64_t count) const {
+    return internal_flinng.hot_buckets(count);
+  }
+
+  std::vector<uint64_t> SparseFlinng32::queryPoints(const uint64_t *const *points, const uint64_t *point_lens,
+                                                    uint64_t num_points, uint64_t top_k) {
+    std::vector<uint64_t> results(num_points * top_k);
+    thread_pool->parallel_for(0, num_points, [&](uint64_t i) {
+      std::vector<uint64_t> hashes(num_hash_tables);
+      single_densified_minhash(hashes.data(), points[i], point_lens[i], num_hash_tables, hashes_per_table,
+                               hash_range_pow, seed);
+      internal_flinng.query_one(hashes.data(), top_k, results.data() + i * top_k);
+    });
+    return results;
+  }
+
   std::vector<uint64_t> SparseFlinng32::query(const std::vector<std::vector<uint64_t>> &queries, uint64_t top_k) {
+    if (thread_pool) {
+      std::vector<const uint64_t *> points;
+      std::vector<uint64_t> point_lens;
+      for (const std::vector<uint64_t> &query: queries) {
+        points.push_back(query.data());
+        point_lens.push_back(query.size());
+      }
+      return queryPoints(points.data(), point_lens.data(), queries.size(), top_k);
+    }
     std::vector<uint64_t> hashes = getHashes(queries);
     std::vector<uint64_t> results = internal_flinng.query(hashes, top_k);
 
     return results;
   }
 
+  std::vector<uint64_t> SparseFlinng32::query(const std::vector<std::vector<uint64_t>> &queries, uint64_t top_k,
+                                              const QueryOptions &options) {
+    QueryOptions without_probes = options;
+    without_probes.num_probes = 1;
+    std::vector<uint64_t> hashes = getHashes(queries);
+    return internal_flinng.query(hashes, top_k, nullptr, &without_probes);
+  }
+
   std::vector<uint64_t>
   SparseFlinng32::querySameDim(const std::vector<uint64_t> &queries, uint64_t num_points, uint64_t point_dimension,
                                uint64_t top_k) {
+    if (thread_pool) {
+      std::vector<const uint64_t *> points;
+      for (uint64_t i = 0; i < num_points; i++) {
+        points.push_back(queries.data() + i * point_dimension);
+      }
+      std::vector<uint64_t> point_lens(num_points, point_dimension);
+      return queryPoints(points.data(), point_lens.data(), num_points, top_k);
+    }
     std::vector<uint64_t> hashes = getHashes(queries.data(), num_points, point_dimension);
     std::vector<uint64_t> results = internal_flinng.query(hashes, top_k);
 
@@ -1,16 +1,77 @@
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <iostream>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 #include <random>
+#include <csignal>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "lib_flinng.h"
+#include "FlinngClient.h"
+#include "NumaTopology.h"
+#include "QueryScheduler.h"
+#include "ShardedFlinng.h"
+#include "StreamingBuilder.h"
+#include "ThreadPool.h"
+#include "Tuner.h"
 
 using namespace std;
 
+static uint64_t count_open_files(pid_t pid) {
+  uint64_t count = 0;
+  DIR *dir = opendir(("/proc/" + to_string(pid) + "/fd").c_str());
+  while (dir != nullptr && readdir(dir) != nullptr) {
+    count++;
+  }
+  if (dir != nullptr) {
+    closedir(dir);
+  }
+  return count;
+}
+
+// Index files go to a fresh directory, removed again however the test exits
+struct TempDir {
+  string path;
+
+  TempDir() {
+    char name[] = "/tmp/flinng_test_XXXXXX";
+    if (mkdtemp(name) == nullptr) {
+      throw runtime_error("Could not create a temporary directory");
+    }
+    path = name;
+  }
+
+  string operator()(const string &file) const {
+    return path + "/" + file;
+  }
+
+  ~TempDir() {
+    DIR *dir = opendir(path.c_str());
+    while (dirent *entry = dir != nullptr ? readdir(dir) : nullptr) {
+      if (string(entry->d_name) != "." && string(entry->d_name) != "..") {
+        unlink((*this)(entry->d_name).c_str());
+      }
+    }
+    if (dir != nullptr) {
+      closedir(dir);
+    }
+    rmdir(path.c_str());
+  }
+};
+
 int main() {
   uint64_t data_dim = 10, dataset_size = 10000, query_size = 100;
   float dataset_std = 1.0f, query_std = 0.1f;
   uint64_t flinng_num_rows = 3, flinngs_cells_per_row =
       dataset_size / 100, flinng_hashes_per_table = 12, flinng_num_hash_tables = 10;
 
+  TempDir tmp;
   srand(100);
   default_random_engine generator;
   normal_distribution<float> dataset_dist(0.0f, dataset_std);
@@ -33,6 +94,7 @@ int main() {
   }
 
   flinng::FlinngBuilder spec(flinng_num_rows, flinngs_cells_per_row, flinng_num_hash_tables, flinng_hashes_per_table);
+  vector<long> dense_ids;
   {
     flinng::DenseFlinng32 index(data_dim, &spec);
     index.add_and_store(dataset.data(), dataset_size);
@@ -47,11 +109,12 @@ int main() {
       cout << distances[i] << ' ';
     }
     cout << "\nRecall (Angular Similarity) = " << static_cast<float>(c) / query_size << endl;
-    index.write_index("dense_index");
+    index.write_index(tmp("dense_index").c_str());
+    dense_ids.assign(ids, ids + query_size);
   }
 
   {
-    std::string file_name="dense_index";
+    std::string file_name=tmp("dense_index");
     flinng::DenseFlinng32 *index = dynamic_cast<flinng::DenseFlinng32*>(flinng::BaseDenseFlinng32::from_index(file_name.c_str()));
     long ids[query_size];
     float distances[query_size];
@@ -79,11 +142,11 @@ int main() {
       cout << distances[i] << ' ';
     }
     cout << "\nRecall (L2 Similarity) = " << static_cast<float>(c) / query_size << endl;
-    index.write_index("l2_index");
+    index.write_index(tmp("l2_index").c_str());
   }
 
   {
-    std::string file_name="l2_index";
+    std::string file_name=tmp("l2_index");
     flinng::L2DenseFlinng32 *index = dynamic_cast<flinng::L2DenseFlinng32*>(flinng::BaseDenseFlinng32::from_index(file_name.c_str()));
     long ids[query_size];
     float distances[query_size];
@@ -97,5 +160,607 @@ int main() {
     cout << "\nRecall (L2 Similarity) = " << static_cast<float>(c) / query_size << endl;
   }
 
+  {
+    vector<uint64_t> shard_cells = {flinngs_cells_per_row / 2, flinngs_cells_per_row / 4, flinngs_cells_per_row / 4};
+    flinng::ShardedDenseFlinng32 index(data_dim, shard_cells, &spec);
+    index.add_and_store(dataset.data(), dataset_size);
+    index.finalize_construction();
+    index.write_index(tmp("sharded_dense_index").c_str());
+    long ids[query_size], by_score[query_size];
+    float distances[query_size];
+    index.search_with_distance(queries.data(), query_size, 1, ids, distances);
+    index.search(queries.data(), query_size, 1, by_score);
+    uint32_t c = 0, dense_c = 0, same = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      c += static_cast<int>(ids[i]) == gt[i];
+      dense_c += static_cast<int>(dense_ids[i]) == gt[i];
+      same += ids[i] == dense_ids[i];
+    }
+    cout << "Recall (Sharded Angular Similarity) = " << static_cast<float>(c) / query_size << ", "
+         << same << " of " << query_size << " as unsharded" << endl;
+
+    flinng::ShardedDenseFlinng32 *loaded = flinng::ShardedDenseFlinng32::from_index(tmp("sharded_dense_index").c_str());
+    long loaded_ids[query_size];
+    loaded->search(queries.data(), query_size, 1, loaded_ids);
+    uint32_t loaded_c = 0, same_loaded = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      loaded_c += static_cast<int>(loaded_ids[i]) == gt[i];
+      same_loaded += loaded_ids[i] == by_score[i];
+    }
+    cout << "Recall (Sharded Angular Similarity, by score) = " << static_cast<float>(loaded_c) / query_size << endl;
+    delete loaded;
+    // Re-ranked by distance the shards find what a single index does
+    if (c + query_size / 20 < dense_c || same_loaded != query_size) {
+      return 1;
+    }
+  }
+
+  {
+    // Both halves load the same empty index so they share their hash functions
+    flinng::DenseFlinng32(data_dim, &spec).write_index(tmp("merge_base_index").c_str());
+    flinng::BaseDenseFlinng32 *first = flinng::BaseDenseFlinng32::from_index(tmp("merge_base_index").c_str());
+    flinng::BaseDenseFlinng32 *second = flinng::BaseDenseFlinng32::from_index(tmp("merge_base_index").c_str());
+    // Cells are drawn with rand, so the single build below draws the same ones
+    srand(200);
+    first->add_and_store(dataset.data(), dataset_size / 2);
+    second->add_and_store(dataset.data() + dataset_size / 2 * data_dim, dataset_size - dataset_size / 2);
+    first->merge(*second);
+    first->finalize_construction();
+    flinng::BaseDenseFlinng32 *single = flinng::BaseDenseFlinng32::from_index(tmp("merge_base_index").c_str());
+    srand(200);
+    single->add_and_store(dataset.data(), dataset_size);
+    single->finalize_construction();
+    long ids[query_size], single_ids[query_size];
+    float distances[query_size], single_distances[query_size];
+    first->search_with_distance(queries.data(), query_size, 1, ids, distances);
+    single->search_with_distance(queries.data(), query_size, 1, single_ids, single_distances);
+    uint32_t c = 0, same = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      c += static_cast<int>(ids[i]) == gt[i];
+      same += ids[i] == single_ids[i];
+    }
+    cout << "Recall (Merged Angular Similarity) = " << static_cast<float>(c) / query_size << ", " << same << " of "
+         << query_size << " as a single build" << endl;
+    delete first;
+    delete second;
+    delete single;
+    if (same != query_size) {
+      return 1;
+    }
+  }
+
+  {
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.add(dataset.data(), dataset_size);
+    index.finalize_construction();
+    vector<flinng::QueryStats> stats;
+    index.query(queries.data(), query_size, 10, stats);
+    uint64_t scanned = 0;
+    for (const flinng::QueryStats &s: stats) {
+      scanned += s.posting_entries_scanned;
+    }
+    cout << "Query stats enabled = " << flinng::stats_enabled() << ", posting entries scanned per query = "
+         << scanned / query_size;
+    if (index.query_stats() != nullptr) {
+      cout << ", p99 latency = " << index.query_stats()->total_ns.percentile(0.99) << " ns";
+    }
+    flinng::HotBucket hottest = index.hot_buckets(1)[0];
+    cout << ", hottest bucket = (" << hottest.table << ", " << hottest.hash << ") of length " << hottest.length
+         << endl;
+    // Without statistics the longest posting list comes first
+    bool consistent = flinng::stats_enabled()
+                      ? scanned > 0 && index.query_stats() != nullptr && hottest.reads > 0
+                      : scanned == 0 && hottest.length == index.bucket_stats().max_length;
+    if (!consistent) {
+      return 1;
+    }
+  }
+
+  {
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.add_and_store(dataset.data(), dataset_size);
+    index.finalize_construction();
+    long before_ids[query_size], ids[query_size];
+    index.search(queries.data(), query_size, 1, before_ids);
+    flinng::MemoryReport before = index.memory_report();
+    index.compact();
+    flinng::MemoryReport after = index.memory_report();
+    index.search(queries.data(), query_size, 1, ids);
+    uint32_t c = 0, same = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      c += static_cast<int>(ids[i]) == gt[i];
+      same += ids[i] == before_ids[i];
+    }
+    cout << "Memory = " << before.total() << " bytes, " << after.total() << " after compact ("
+         << after.wasted() << " spare), recall after compact = " << static_cast<float>(c) / query_size << endl;
+    if (after.total() > before.total() || after.wasted() > before.wasted() || same != query_size) {
+      return 1;
+    }
+  }
+
+  {
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.add(dataset.data(), dataset_size);
+    index.finalize_construction();
+    flinng::QueryOptions subset, early_stop, multi_probe, every_table, never_stop;
+    subset.num_tables = flinng_num_hash_tables / 2;
+    early_stop.early_stop_z = 2;
+    early_stop.check_interval = 2;
+    multi_probe.num_probes = 2;
+    every_table.num_tables = flinng_num_hash_tables;
+    never_stop.early_stop_z = 1e9;
+    vector<pair<string, flinng::QueryOptions>> tiers = {
+        {"Half of the Tables", subset}, {"Early Termination", early_stop}, {"Multi-probe", multi_probe},
+        {"Every Table", every_table}, {"Never Stopping", never_stop}};
+    vector<uint64_t> full = index.query(queries.data(), query_size, 1);
+    uint32_t full_c = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      full_c += static_cast<int>(full[i]) == gt[i];
+    }
+    vector<uint32_t> recalls;
+    for (const pair<string, flinng::QueryOptions> &tier: tiers) {
+      vector<uint64_t> results = index.query(queries.data(), query_size, 1, tier.second);
+      uint32_t c = 0;
+      for (uint64_t i = 0; i < query_size; ++i) {
+        c += static_cast<int>(results[i]) == gt[i];
+      }
+      recalls.push_back(c);
+      cout << "Recall (" << tier.first << ") = " << static_cast<float>(c) / query_size
+           << (results == full ? ", same as without options" : "") << endl;
+      // Options that drop nothing must not change any result
+      if (tier.first == "Every Table" || tier.first == "Never Stopping") {
+        if (results != full) {
+          return 1;
+        }
+      }
+    }
+    // Early termination only stops once the leaders are settled, and extra
+    // probes only add to the counts of the hashed buckets
+    if (recalls[1] + query_size / 10 < full_c || recalls[2] < full_c) {
+      return 1;
+    }
+  }
+
+  {
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.add(dataset.data(), dataset_size);
+    index.finalize_construction();
+    vector<uint32_t> labels(dataset_size);
+    for (uint64_t i = 0; i < dataset_size; ++i) {
+      labels[i] = i % 4;
+    }
+    index.set_labels(0, labels.data(), dataset_size);
+    index.write_index(tmp("labeled_index").c_str());
+    flinng::BaseDenseFlinng32 *loaded = flinng::BaseDenseFlinng32::from_index(tmp("labeled_index").c_str());
+    flinng::LabelFilter filter = flinng::LabelFilter::allow({1});
+    flinng::QueryOptions options;
+    options.filter = &filter;
+    const unsigned k = 10;
+    vector<long> ids(query_size * k);
+    loaded->search(queries.data(), query_size, k, ids.data(), options);
+    uint32_t matching = 0, c = 0, labeled = 0, other = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      for (uint64_t j = 0; j < k; ++j) {
+        matching += ids[i * k + j] >= 0 && labels[ids[i * k + j]] == 1;
+        other += ids[i * k + j] >= 0 && loaded->label(ids[i * k + j]) != 1;
+      }
+      if (labels[gt[i]] == 1) {
+        labeled++;
+        c += ids[i * k] == gt[i];
+      }
+    }
+    cout << "Filtered results with the allowed label = " << static_cast<float>(matching) / (query_size * k)
+         << ", recall (Filtered Angular Similarity) = " << static_cast<float>(c) / labeled << endl;
+    delete loaded;
+    if (matching == 0 || other > 0) {
+      return 1;
+    }
+  }
+
+  {
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.add_and_store(dataset.data(), dataset_size);
+    index.finalize_construction();
+    flinng::BucketBalance balance;
+    balance.oversize_factor = 4;
+    index.balance_buckets(balance);
+    const flinng::BucketStats &buckets = index.bucket_stats();
+    cout << "Oversized buckets = " << buckets.num_oversized << " of " << buckets.num_lists - buckets.num_empty
+         << " holding " << buckets.oversized_entries << " of " << buckets.total_entries << " entries" << endl;
+    vector<pair<string, flinng::BucketPolicy>> policies = {{"Capped", flinng::BucketPolicy::cap},
+                                                           {"Down-weighted", flinng::BucketPolicy::down_weight},
+                                                           {"Split", flinng::BucketPolicy::split}};
+    uint64_t unsplit_bytes = index.memory_report().posting_lists.used;
+    for (const pair<string, flinng::BucketPolicy> &policy: policies) {
+      balance.policy = policy.second;
+      index.balance_buckets(balance);
+      index.write_index(tmp("balanced_index").c_str());
+      flinng::BaseDenseFlinng32 *loaded = flinng::BaseDenseFlinng32::from_index(tmp("balanced_index").c_str());
+      long ids[query_size], loaded_ids[query_size];
+      index.search(queries.data(), query_size, 1, ids);
+      loaded->search(queries.data(), query_size, 1, loaded_ids);
+      uint32_t c = 0, same = 0;
+      for (uint64_t i = 0; i < query_size; ++i) {
+        c += static_cast<int>(ids[i]) == gt[i];
+        same += loaded_ids[i] == ids[i];
+      }
+      uint64_t posting_bytes = loaded->memory_report().posting_lists.used;
+      cout << "Recall (" << policy.first << " Buckets) = " << static_cast<float>(c) / query_size
+           << ", posting lists = " << posting_bytes << " bytes" << endl;
+      // The loaded index must balance like the one written, with split lists
+      // next to the oversized ones
+      bool balanced = same == query_size && loaded->bucket_stats().threshold == index.bucket_stats().threshold &&
+                      (policy.second != flinng::BucketPolicy::split || posting_bytes > unsplit_bytes);
+      delete loaded;
+      if (!balanced) {
+        return 1;
+      }
+    }
+
+    // Splitting on the thread pool draws the same cells and projections
+    vector<long> split_ids[2];
+    for (unsigned num_threads: {0, 2}) {
+      srand(300);
+      flinng::DenseFlinng32 split_index(data_dim, &spec);
+      split_index.set_num_threads(num_threads);
+      split_index.add_and_store(dataset.data(), dataset_size);
+      split_index.finalize_construction();
+      balance.policy = flinng::BucketPolicy::split;
+      split_index.balance_buckets(balance);
+      split_ids[num_threads / 2].resize(query_size);
+      split_index.search(queries.data(), query_size, 1, split_ids[num_threads / 2].data());
+    }
+    if (split_ids[0] != split_ids[1]) {
+      return 1;
+    }
+  }
+
+  {
+    // Far outside the fixed bins, which then hold nearly every point in their outermost bins
+    vector<float> scaled_dataset(dataset), scaled_queries(queries);
+    for (float &x: scaled_dataset) {
+      x = x * 100 + 50;
+    }
+    for (float &x: scaled_queries) {
+      x = x * 100 + 50;
+    }
+    for (bool calibrate: {false, true}) {
+      flinng::FlinngBuilder l2_spec = spec;
+      l2_spec.hashes_per_table = 6;
+      l2_spec.calibrate_bins = calibrate;
+      flinng::L2DenseFlinng32 index(data_dim, &l2_spec);
+      index.add(scaled_dataset.data(), dataset_size);
+      index.finalize_construction();
+      index.write_index(tmp("calibrated_index").c_str());
+      flinng::BaseDenseFlinng32 *loaded = flinng::BaseDenseFlinng32::from_index(tmp("calibrated_index").c_str());
+      long ids[query_size];
+      loaded->search(scaled_queries.data(), query_size, 1, ids);
+      uint32_t c = 0;
+      for (uint64_t i = 0; i < query_size; ++i) {
+        c += static_cast<int>(ids[i]) == gt[i];
+      }
+      cout << "Recall (" << (calibrate ? "Calibrated" : "Fixed") << " L2 Bins, Unnormalized) = "
+           << static_cast<float>(c) / query_size << ", longest bucket = " << loaded->bucket_stats().max_length
+           << endl;
+      delete loaded;
+    }
+
+    // Copies of one calibrated empty index share their bins, so they can be merged
+    flinng::FlinngBuilder l2_spec = spec;
+    l2_spec.hashes_per_table = 6;
+    l2_spec.calibrate_bins = true;
+    {
+      flinng::L2DenseFlinng32 empty(data_dim, &l2_spec);
+      empty.calibrate(scaled_dataset.data(), dataset_size);
+      empty.write_index(tmp("calibrated_empty_index").c_str());
+    }
+    flinng::BaseDenseFlinng32 *first = flinng::BaseDenseFlinng32::from_index(tmp("calibrated_empty_index").c_str());
+    flinng::BaseDenseFlinng32 *second = flinng::BaseDenseFlinng32::from_index(tmp("calibrated_empty_index").c_str());
+    first->add(scaled_dataset.data(), dataset_size / 2);
+    second->add(scaled_dataset.data() + dataset_size / 2 * data_dim, dataset_size - dataset_size / 2);
+    first->merge(*second);
+    first->finalize_construction();
+    long ids[query_size];
+    first->search(scaled_queries.data(), query_size, 1, ids);
+    uint32_t c = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      c += static_cast<int>(ids[i]) == gt[i];
+    }
+    delete first;
+    delete second;
+
+    // A single point cannot place the bins
+    flinng::L2DenseFlinng32 tiny(data_dim, &l2_spec);
+    tiny.add(scaled_dataset.data(), 1);
+    cout << "Recall (Merged Calibrated L2 Bins) = " << static_cast<float>(c) / query_size
+         << ", calibrated on a 1 point add = " << tiny.is_calibrated() << endl;
+    if (tiny.is_calibrated() || !tiny.calibration_skipped()) {
+      return 1;
+    }
+  }
+
+  {
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.store_signatures(true);
+    index.add(dataset.data(), dataset_size);
+    index.finalize_construction();
+    index.regroup(flinng_num_rows + 1, flinngs_cells_per_row * 2);
+    index.write_index(tmp("regrouped_index").c_str());
+    flinng::BaseDenseFlinng32 *loaded = flinng::BaseDenseFlinng32::from_index(tmp("regrouped_index").c_str());
+    long ids[query_size];
+    loaded->search(queries.data(), query_size, 1, ids);
+    uint32_t c = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      c += static_cast<int>(ids[i]) == gt[i];
+    }
+    cout << "Recall (Regrouped Angular Similarity) = " << static_cast<float>(c) / query_size
+         << ", signatures = " << loaded->memory_report().signatures.used << " bytes" << endl;
+    delete loaded;
+  }
+
+  {
+    vector<int> ids = flinng::parse_id_list("0-3,8,10-11\n");
+    vector<flinng::NumaNode> nodes = flinng::numa_topology();
+    uint64_t num_cpus = 0;
+    for (const flinng::NumaNode &node: nodes) {
+      num_cpus += node.cpus.size();
+    }
+    cout << "Parsed cpu list = " << ids.size() << " ids, last " << ids.back() << ", NUMA nodes = " << nodes.size()
+         << " with " << num_cpus << " cpus" << endl;
+    if (ids != vector<int>{0, 1, 2, 3, 8, 10, 11} || nodes.empty() || num_cpus == 0) {
+      return 1;
+    }
+
+    // Two logical nodes on the cpus of the first make replicas on any machine
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.add_and_store(dataset.data(), dataset_size);
+    index.finalize_construction();
+    flinng::QueryOptions multi_probe;
+    multi_probe.num_probes = 4;
+    vector<long> plain(query_size), probed(query_size), numa_plain(query_size), numa_probed(query_size);
+    vector<float> distances(query_size), numa_distances(query_size);
+    index.search(queries.data(), query_size, 1, plain.data());
+    index.search(queries.data(), query_size, 1, probed.data(), multi_probe);
+    index.search_with_distance(queries.data(), query_size, 1, plain.data(), distances.data());
+    flinng::NumaNode second = nodes[0];
+    second.id = 1;
+    index.enable_numa_replication({nodes[0], second});
+    index.search(queries.data(), query_size, 1, numa_plain.data());
+    index.search(queries.data(), query_size, 1, numa_probed.data(), multi_probe);
+    index.search_with_distance(queries.data(), query_size, 1, numa_plain.data(), numa_distances.data());
+    uint64_t replica_bytes = index.memory_report().numa_replicas.total();
+    cout << "NUMA replicas = " << replica_bytes << " bytes, results "
+         << (numa_plain == plain && numa_probed == probed && numa_distances == distances ? "match" : "differ")
+         << endl;
+    if (replica_bytes == 0 || numa_plain != plain || numa_probed != probed || numa_distances != distances) {
+      return 1;
+    }
+  }
+
+#ifdef FLINNG_SERVER_PATH
+  {
+    // Round trip through a flinng_server child serving the first index
+    string socket_path = "/tmp/flinng_test_" + to_string(getpid()) + ".sock";
+    pid_t server = fork();
+    if (server == 0) {
+      int devnull = open("/dev/null", O_WRONLY);
+      dup2(devnull, STDOUT_FILENO);
+      execl(FLINNG_SERVER_PATH, "flinng_server", socket_path.c_str(), tmp("dense_index").c_str(), (char *) nullptr);
+      _exit(127);
+    }
+    unique_ptr<flinng::FlinngClient> client;
+    for (int attempt = 0; attempt < 100 && !(client && client->connected()); attempt++) {
+      this_thread::sleep_for(chrono::milliseconds(50));
+      client.reset(new flinng::FlinngClient(socket_path.c_str()));
+    }
+    uint64_t dimension = 0, num_points = 0;
+    long ids[query_size], plain_ids[query_size];
+    float distances[query_size];
+    bool served = client->connected() && client->info(0, dimension, num_points) &&
+                  client->search(0, queries.data(), query_size, 1, ids, distances) &&
+                  client->search(0, queries.data(), query_size, 1, plain_ids);
+    uint32_t c = 0;
+    for (uint64_t i = 0; served && i < query_size; ++i) {
+      c += static_cast<int>(ids[i]) == gt[i];
+      served = plain_ids[i] == ids[i];
+    }
+
+    // Closed connections must release their sockets
+    uint64_t files_before = count_open_files(server);
+    for (int i = 0; i < 50; i++) {
+      flinng::FlinngClient other(socket_path.c_str());
+      served = served && other.info(0, dimension, num_points);
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+    uint64_t files_after = count_open_files(server);
+    client.reset();
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    cout << "Recall (Served Angular Similarity) = " << static_cast<float>(c) / query_size << ", server files "
+         << files_before << " -> " << files_after << " after 50 connections" << endl;
+    if (!served || num_points != dataset_size || files_after > files_before + 2) {
+      return 1;
+    }
+  }
+#endif
+
+  {
+    // Skewed work makes the threads that finish first steal from the others
+    flinng::ThreadPool pool(4);
+    uint64_t num_items = 100000;
+    vector<atomic<uint32_t>> visits(num_items);
+    for (atomic<uint32_t> &v: visits) {
+      v.store(0);
+    }
+    pool.parallel_for(0, num_items, [&](uint64_t i) {
+      volatile uint64_t work = 0;
+      for (uint64_t j = 0; j < (i < num_items / 4 ? 200 : 1); j++) {
+        work = work + j;
+      }
+      visits[i]++;
+    });
+    uint64_t covered = 0;
+    for (atomic<uint32_t> &v: visits) {
+      covered += v.load() == 1;
+    }
+    bool rethrown = false;
+    try {
+      pool.parallel_for(0, num_items, [](uint64_t i) {
+        if (i == 500) {
+          throw runtime_error("task failed");
+        }
+      });
+    } catch (const runtime_error &) {
+      rethrown = true;
+    }
+    atomic<uint64_t> after(0);
+    pool.parallel_for(0, 1000, [&](uint64_t) { after++; });
+    cout << "ThreadPool covered " << covered << " of " << num_items << " items once, exception "
+         << (rethrown ? "rethrown" : "lost") << ", " << after.load() << " items after it" << endl;
+    if (covered != num_items || !rethrown || after.load() != 1000) {
+      return 1;
+    }
+
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.set_num_threads(4);
+    index.add(dataset.data(), dataset_size);
+    index.finalize_construction();
+    long ids[query_size];
+    index.search(queries.data(), query_size, 1, ids);
+    uint32_t c = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      c += static_cast<int>(ids[i]) == gt[i];
+    }
+    cout << "Recall (Thread Pool Angular Similarity) = " << static_cast<float>(c) / query_size << endl;
+  }
+
+  {
+    flinng::DenseFlinng32 index(data_dim, &spec);
+    index.add(dataset.data(), dataset_size / 2);
+    index.finalize_construction();
+    vector<long> direct(query_size);
+    index.search(queries.data(), query_size, 1, direct.data());
+
+    flinng::QueryScheduler scheduler(index, 16, chrono::microseconds(2000));
+    // Submitted from several threads so that batches mix their queries
+    vector<future<flinng::QueryScheduler::Result>> results(query_size);
+    vector<thread> submitters;
+    for (uint64_t t = 0; t < 4; t++) {
+      submitters.emplace_back([&, t]() {
+        for (uint64_t i = t; i < query_size; i += 4) {
+          results[i] = scheduler.submit(queries.data() + i * data_dim, 1);
+        }
+      });
+    }
+    for (thread &submitter: submitters) {
+      submitter.join();
+    }
+    uint32_t same = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      same += results[i].get().ids[0] == direct[i];
+    }
+
+    scheduler.run_exclusive([&]() {
+      index.add(dataset.data() + dataset_size / 2 * data_dim, dataset_size - dataset_size / 2);
+      index.finalize_construction();
+    }).get();
+    uint32_t c = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      c += scheduler.submit(queries.data() + i * data_dim, 1).get().ids[0] == gt[i];
+    }
+
+    bool task_error = false, search_error = false;
+    try {
+      scheduler.run_exclusive([]() { throw runtime_error("task failed"); }).get();
+    } catch (const runtime_error &) {
+      task_error = true;
+    }
+    {
+      flinng::QueryScheduler distance_scheduler(index, 16, chrono::microseconds(2000), true);
+      try {
+        distance_scheduler.submit(queries.data(), 1).get();
+      } catch (const runtime_error &) {
+        search_error = true;
+      }
+    }
+    cout << "Scheduled batches = " << same << " of " << query_size << " as direct search, recall after exclusive add = "
+         << static_cast<float>(c) / query_size << ", errors " << (task_error && search_error ? "rethrown" : "lost")
+         << endl;
+    if (same != query_size || !task_error || !search_error) {
+      return 1;
+    }
+  }
+
+  {
+    // Small runs and fan-in so the runs are merged over several levels
+    flinng::DenseFlinng32 empty(data_dim, &spec);
+    flinng::StreamingIndexBuilder builder(empty, tmp.path.c_str(), dataset_size / 20, true, 3);
+    builder.add(dataset.data(), dataset_size);
+    builder.write_index(tmp("streamed_index").c_str());
+    bool finished = false;
+    try {
+      builder.add(dataset.data(), 1);
+    } catch (const logic_error &) {
+      finished = true;
+    }
+    flinng::BaseDenseFlinng32 *loaded = flinng::BaseDenseFlinng32::from_index(tmp("streamed_index").c_str());
+    long ids[query_size];
+    float distances[query_size];
+    loaded->search_with_distance(queries.data(), query_size, 1, ids, distances);
+    uint32_t c = 0;
+    for (uint64_t i = 0; i < query_size; ++i) {
+      c += static_cast<int>(ids[i]) == gt[i];
+    }
+    cout << "Recall (Streamed Angular Similarity) = " << static_cast<float>(c) / query_size
+         << ", points = " << loaded->num_points_added() << ", oversize threshold = "
+         << loaded->bucket_stats().threshold << ", add after write " << (finished ? "rejected" : "accepted")
+         << endl;
+    bool has_stats = loaded->bucket_stats().threshold > 0;
+    delete loaded;
+    if (!has_stats || !finished) {
+      return 1;
+    }
+  }
+
+  {
+    flinng::TuningGoal goal;
+    goal.k = 1;
+    goal.target_recall = 0.5;
+    goal.full_size = dataset_size * 10;
+    flinng::TuningSpace space;
+    space.num_rows = {flinng_num_rows};
+    space.points_per_cell = {100};
+    space.num_hash_tables = {flinng_num_hash_tables, flinng_num_hash_tables * 2};
+    space.hashes_per_table = {flinng_hashes_per_table};
+    flinng::TuningResult tuned = flinng::tune_parameters(dataset.data(), dataset_size, queries.data(), query_size,
+                                                         data_dim, goal, space);
+    tuned.print(cout);
+
+    // A budget between the two candidates leaves only the smaller one
+    uint64_t smallest = UINT64_MAX, largest = 0;
+    for (const flinng::TuningCandidate &candidate: tuned.candidates) {
+      smallest = min(smallest, candidate.projected_memory);
+      largest = max(largest, candidate.projected_memory);
+    }
+    goal.memory_budget = smallest + (largest - smallest) / 2;
+    flinng::TuningResult budgeted = flinng::tune_parameters(dataset.data(), dataset_size, queries.data(),
+                                                            query_size, data_dim, goal, space);
+    budgeted.print(cout);
+    for (const flinng::TuningResult *result: {&tuned, &budgeted}) {
+      const flinng::TuningCandidate *chosen = nullptr;
+      for (const flinng::TuningCandidate &candidate: result->candidates) {
+        const flinng::FlinngBuilder &a = candidate.spec, &b = result->spec;
+        if (!candidate.skipped && a.num_rows == b.num_rows && a.cells_per_row == b.cells_per_row &&
+            a.num_hash_tables == b.num_hash_tables && a.hashes_per_table == b.hashes_per_table) {
+          chosen = &candidate;
+        }
+      }
+      bool within_budget = chosen != nullptr && (result == &tuned || chosen->projected_memory <= goal.memory_budget);
+      if (!result->meets_goal || !within_budget) {
+        return 1;
+      }
+    }
+  }
+
   return 0;
 }
@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "GroundTruth.h"
+#include "lib_flinng.h"
+
+using namespace std;
+using namespace flinng;
+
+// Measures the recall/throughput tradeoff of FLINNG on local ANN datasets.
+// Every combination of the swept FlinngBuilder parameters is built and
+// queried, and the results are reported as a table with the Pareto-optimal
+// (recall, QPS) configurations marked.
+
+struct Run {
+  FlinngBuilder spec;
+  double build_seconds, qps, recall, memory_mb;
+  bool pareto;
+};
+
+static vector<uint64_t> parse_list(const string &arg) {
+  vector<uint64_t> values;
+  stringstream ss(arg);
+  string value;
+  while (getline(ss, value, ',')) {
+    values.push_back(stoull(value));
+  }
+  return values;
+}
+
+template<typename F>
+static double time_seconds(F fn) {
+  auto start = chrono::steady_clock::now();
+  fn();
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void usage() {
+  cerr << "Usage: flinng_eval --base <file> --query <file> [--gt <ivecs file>]\n"
+       << "                   [--format fvecs|bvecs|float32|sparse] [--dim <d, for float32>]\n"
+       << "                   [--metric angular|l2] [--k <k>] [--max-queries <n>]\n"
+       << "                   [--num-rows <list>] [--cells-per-row <list>] [--tables <list>]\n"
+       << "                   [--hashes-per-table <list>] [--sub-hash-bits <b>] [--cutoff <c>]\n"
+       << "                   [--hash-range-pow <p, sparse only>] [--csv <file>]\n"
+       << "Lists are comma separated, every combination is evaluated. Without --gt the exact\n"
+       << "neighbors are computed by brute force." << endl;
+}
+
+int main(int argc, char **argv) {
+  string base_file, query_file, gt_file, csv_file, format = "fvecs", metric = "angular";
+  uint64_t dim = 0, max_queries = 0, sub_hash_bits = 2, cutoff = 6, hash_range_pow = 16;
+  uint32_t k = 10;
+  vector<uint64_t> num_rows = {3}, cells_per_row = {1 << 12}, tables = {1 << 9}, hashes_per_table = {14};
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    string value = argv[++i];
+    if (arg == "--base") {
+      base_file = value;
+    } else if (arg == "--query") {
+      query_file = value;
+    } else if (arg == "--gt") {
+      gt_file = value;
+    } else if (arg == "--csv") {
+      csv_file = value;
+    } else if (arg == "--format") {
+      format = value;
+    } else if (arg == "--metric") {
+      metric = value;
+    } else if (arg == "--dim") {
+      dim = stoull(value);
+    } else if (arg == "--k") {
+      k = stoul(value);
+    } else if (arg == "--max-queries") {
+      max_queries = stoull(value);
+    } else if (arg == "--num-rows") {
+      num_rows = parse_list(value);
+    } else if (arg == "--cells-per-row") {
+      cells_per_row = parse_list(value);
+    } else if (arg == "--tables") {
+      tables = parse_list(value);
+    } else if (arg == "--hashes-per-table") {
+      hashes_per_table = parse_list(value);
+    } else if (arg == "--sub-hash-bits") {
+      sub_hash_bits = stoull(value);
+    } else if (arg == "--cutoff") {
+      cutoff = stoull(value);
+    } else if (arg == "--hash-range-pow") {
+      hash_range_pow = stoull(value);
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (base_file.empty() || query_file.empty() || (metric != "angular" && metric != "l2")) {
+    usage();
+    return 1;
+  }
+  bool sparse = format == "sparse", l2 = metric == "l2";
+
+  // Load data
+  vector<float> base, queries;
+  vector<vector<uint64_t>> sparse_base, sparse_queries;
+  uint64_t num_points, num_queries;
+  if (sparse) {
+    if (!read_sparse_vectors(base_file.c_str(), sparse_base) ||
+        !read_sparse_vectors(query_file.c_str(), sparse_queries)) {
+      cerr << "Error while reading sparse vectors" << endl;
+      return 1;
+    }
+    if (max_queries > 0 && sparse_queries.size() > max_queries) {
+      sparse_queries.resize(max_queries);
+    }
+    num_points = sparse_base.size();
+    num_queries = sparse_queries.size();
+  } else {
+    VectorFormat vector_format = format == "bvecs" ? VectorFormat::bvecs
+                                                   : format == "float32" ? VectorFormat::float32 : VectorFormat::fvecs;
+    VectorFileReader base_reader(base_file.c_str(), vector_format, dim);
+    VectorFileReader query_reader(query_file.c_str(), vector_format, dim);
+    if (!base_reader.good() || !query_reader.good() || base_reader.dimension() != query_reader.dimension()) {
+      cerr << "Error while reading dense vectors" << endl;
+      return 1;
+    }
+    dim = base_reader.dimension();
+    vector<float> chunk;
+    while (uint64_t num_read = base_reader.read(chunk, 1 << 16)) {
+      base.insert(base.end(), chunk.begin(), chunk.begin() + num_read * dim);
+    }
+    while (max_queries == 0 || queries.size() / dim < max_queries) {
+      uint64_t left = max_queries == 0 ? 1 << 16 : min<uint64_t>(1 << 16, max_queries - queries.size() / dim);
+      uint64_t num_read = query_reader.read(chunk, left);
+      if (num_read == 0) {
+        break;
+      }
+      queries.insert(queries.end(), chunk.begin(), chunk.begin() + num_read * dim);
+    }
+    num_points = base.size() / dim;
+    num_queries = queries.size() / dim;
+  }
+  cout << "Loaded " << num_points << " points and " << num_queries << " queries" << endl;
+
+  // Ground truth
+  vector<uint64_t> ground_truth;
+  uint64_t gt_stride = k;
+  if (!gt_file.empty()) {
+    vector<int32_t> gt_values;
+    if (!read_ivecs(gt_file.c_str(), gt_values, gt_stride) || gt_stride < k ||
+        gt_values.size() / gt_stride < num_queries) {
+      cerr << "Ground truth must hold at least " << k << " neighbors for every query" << endl;
+      return 1;
+    }
+    ground_truth.assign(gt_values.begin(), gt_values.end());
+  } else {
+    double seconds = time_seconds([&]() {
+      ground_truth = sparse ? brute_force_knn(sparse_base, sparse_queries, k)
+                            : brute_force_knn(base.data(), num_points, queries.data(), num_queries, dim, k, l2);
+    });
+    cout << "Computed ground truth by brute force in " << seconds << " s" << endl;
+  }
+
+  // Sweep
+  vector<Run> runs;
+  for (uint64_t rows: num_rows) {
+    for (uint64_t cells: cells_per_row) {
+      for (uint64_t num_tables: tables) {
+        for (uint64_t hashes: hashes_per_table) {
+          Run run;
+          run.spec = FlinngBuilder(rows, cells, num_tables, hashes, sub_hash_bits, cutoff);
+          vector<uint64_t> results;
+
+          if (sparse) {
+            SparseFlinng32 index(rows, cells, num_tables, hashes, hash_range_pow);
+            run.build_seconds = time_seconds([&]() {
+              index.addPoints(sparse_base);
+              index.prepareForQueries();
+            });
+            run.memory_mb = static_cast<double>(index.memory_report().total()) / (1 << 20);
+            run.qps = num_queries / time_seconds([&]() { results = index.query(sparse_queries, k); });
+          } else {
+            unique_ptr<BaseDenseFlinng32> index;
+            if (l2) {
+              index.reset(new L2DenseFlinng32(dim, &run.spec));
+            } else {
+              index.reset(new DenseFlinng32(dim, &run.spec));
+            }
+            run.build_seconds = time_seconds([&]() {
+              index->add(base.data(), num_points);
+              index->finalize_construction();
+            });
+            run.memory_mb = static_cast<double>(index->memory_report().total()) / (1 << 20);
+            run.qps = num_queries / time_seconds([&]() { results = index->query(queries.data(), num_queries, k); });
+          }
+
+          run.recall = recall_at_k(results, k, ground_truth, gt_stride, num_queries, k, k);
+          runs.push_back(run);
+          cout << "num_rows=" << rows << " cells_per_row=" << cells << " tables=" << num_tables
+               << " hashes_per_table=" << hashes << ": recall@" << k << "=" << run.recall
+               << " qps=" << run.qps << endl;
+        }
+      }
+    }
+  }
+
+  // A run is Pareto-optimal if no other run is at least as good in both
+  // recall and QPS and strictly better in one
+  for (Run &run: runs) {
+    run.pareto = true;
+    for (const Run &other: runs) {
+      if (other.recall >= run.recall && other.qps >= run.qps && (other.recall > run.recall || other.qps > run.qps)) {
+        run.pareto = false;
+      }
+    }
+  }
+  sort(runs.begin(), runs.end(), [](const Run &a, const Run &b) { return a.recall > b.recall; });
+
+  cout << "\n" << setw(8) << "num_rows" << setw(14) << "cells_per_row" << setw(8) << "tables"
+       << setw(18) << "hashes_per_table" << setw(12) << "recall@" + to_string(k) << setw(12) << "qps"
+       << setw(12) << "build_s" << setw(12) << "memory_mb" << setw(8) << "pareto" << "\n";
+  for (const Run &run: runs) {
+    cout << setw(8) << run.spec.num_rows << setw(14) << run.spec.cells_per_row << setw(8) << run.spec.num_hash_tables
+         << setw(18) << run.spec.hashes_per_table << setw(12) << fixed << setprecision(4) << run.recall
+         << setw(12) << setprecision(1) << run.qps << setw(12) << setprecision(2) << run.build_seconds
+         << setw(12) << setprecision(1) << run.memory_mb << setw(8) << (run.pareto ? "*" : "") << "\n";
+  }
+
+  if (!csv_file.empty()) {
+    ofstream csv(csv_file);
+    csv << "num_rows,cells_per_row,num_hash_tables,hashes_per_table,recall,qps,build_seconds,memory_mb,pareto\n";
+    for (const Run &run: runs) {
+      csv << run.spec.num_rows << "," << run.spec.cells_per_row << "," << run.spec.num_hash_tables << ","
+          << run.spec.hashes_per_table << "," << run.recall << "," << run.qps << "," << run.build_seconds << ","
+          << run.memory_mb << "," << run.pareto << "\n";
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FlinngClient.h"
+
+using namespace std;
+using namespace flinng;
+
+// Drives a running flinng_server with random queries from several
+// connections, each keeping a fixed number of pipelined requests in flight,
+// and reports throughput and latency percentiles.
+
+static void usage() {
+  cerr << "Usage: flinng_loadgen <socket_path> [--index <id>] [--requests <per connection>]\n"
+       << "                      [--batch <queries per request>] [--pipeline <requests in flight>]\n"
+       << "                      [--connections <n>] [--k <top_k>] [--distance]" << endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+
+  string socket_path = argv[1];
+  uint32_t index_id = 0, batch = 1, pipeline = 8, top_k = 10;
+  uint64_t requests = 10000, num_connections = 4;
+  bool with_distance = false;
+  for (int i = 2; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--distance") {
+      with_distance = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    uint64_t value = stoull(argv[++i]);
+    if (arg == "--index") {
+      index_id = value;
+    } else if (arg == "--requests") {
+      requests = value;
+    } else if (arg == "--batch") {
+      batch = max<uint64_t>(1, value);
+    } else if (arg == "--pipeline") {
+      pipeline = max<uint64_t>(1, value);
+    } else if (arg == "--connections") {
+      num_connections = max<uint64_t>(1, value);
+    } else if (arg == "--k") {
+      top_k = value;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  uint64_t dimension, num_points;
+  {
+    FlinngClient client(socket_path.c_str());
+    if (!client.connected() || !client.info(index_id, dimension, num_points)) {
+      cerr << client.last_error() << endl;
+      return 1;
+    }
+  }
+  cout << "Index " << index_id << ": " << num_points << " points of dimension " << dimension << endl;
+
+  vector<vector<double>> latencies(num_connections);
+  atomic<uint64_t> failures(0);
+  auto start = chrono::steady_clock::now();
+
+  vector<thread> threads;
+  for (uint64_t c = 0; c < num_connections; c++) {
+    threads.emplace_back([&, c]() {
+      FlinngClient client(socket_path.c_str());
+      if (!client.connected()) {
+        failures += requests;
+        return;
+      }
+      default_random_engine generator(c);
+      normal_distribution<float> dist(0.0f, 1.0f);
+      vector<float> queries(batch * dimension);
+      map<uint32_t, chrono::steady_clock::time_point> in_flight;
+
+      uint64_t sent = 0, done = 0;
+      while (done < requests) {
+        while (sent < requests && in_flight.size() < pipeline) {
+          for (float &value: queries) {
+            value = dist(generator);
+          }
+          uint32_t request_id = client.send_search(index_id, queries.data(), batch, dimension, top_k, with_distance);
+          if (request_id == 0) {
+            failures += requests - done;
+            return;
+          }
+          in_flight[request_id] = chrono::steady_clock::now();
+          sent++;
+        }
+
+        FlinngClient::Response response;
+        if (!client.receive(response)) {
+          failures += requests - done;
+          return;
+        }
+        auto sent_at = in_flight.find(response.request_id);
+        if (sent_at != in_flight.end()) {
+          latencies[c].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sent_at->second).count());
+          in_flight.erase(sent_at);
+        }
+        failures += response.status != protocol::OK;
+        done++;
+      }
+    });
+  }
+  for (thread &t: threads) {
+    t.join();
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  vector<double> all;
+  for (vector<double> &l: latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  sort(all.begin(), all.end());
+  auto percentile = [&all](double p) {
+    return all.empty() ? 0.0 : all[min<uint64_t>(all.size() - 1, p * all.size())];
+  };
+
+  cout << "Requests: " << all.size() << ", failed: " << failures << ", queries/s: "
+       << all.size() * batch / seconds << endl;
+  cout << "Latency (us) p50: " << percentile(0.5) << ", p90: " << percentile(0.9) << ", p99: "
+       << percentile(0.99) << ", max: " << (all.empty() ? 0.0 : all.back()) << endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,347 @@
+#include <atomic>
+#include <csignal>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "FlinngProtocol.h"
+#include "QueryScheduler.h"
+#include "lib_flinng.h"
+
+using namespace std;
+using namespace flinng;
+
+// Serves dense indexes over a Unix domain socket, see FlinngProtocol.h for
+// the wire format. Queries of all connections go through one QueryScheduler
+// per index, so concurrent clients are batched together on the server.
+
+static atomic<bool> running(true);
+
+static void stop(int) {
+  running = false;
+}
+
+struct ServedIndex {
+  unique_ptr<BaseDenseFlinng32> index;
+  unique_ptr<QueryScheduler> scheduler;
+};
+
+struct Connection {
+  int fd;
+  mutex write_mutex;
+
+  explicit Connection(int fd) : fd(fd) {}
+
+  ~Connection() { close(fd); }
+
+  void send(const protocol::Writer &response) {
+    lock_guard<mutex> lock(write_mutex);
+    protocol::send_frame(fd, response.data());
+  }
+};
+
+static protocol::Writer response_header(uint8_t status, uint8_t opcode, uint32_t request_id) {
+  protocol::Writer response;
+  response.put(status);
+  response.put(opcode);
+  response.put(request_id);
+  return response;
+}
+
+static void send_error(Connection &connection, uint8_t opcode, uint32_t request_id, const string &message) {
+  protocol::Writer response = response_header(protocol::ERROR, opcode, request_id);
+  uint32_t length = message.size();
+  response.put(length);
+  response.put_array(message.data(), length);
+  connection.send(response);
+}
+
+static string error_message(exception_ptr error) {
+  try {
+    rethrow_exception(error);
+  } catch (const exception &e) {
+    return e.what();
+  } catch (...) {
+    return "Unknown error";
+  }
+}
+
+// Collects the per-query results of one SEARCH request, which are scheduled
+// individually so that they can be batched with other clients' queries
+struct PendingSearch {
+  shared_ptr<Connection> connection;
+  uint8_t opcode;
+  uint32_t request_id, num_queries, top_k;
+  vector<int64_t> ids;
+  vector<float> distances;
+  atomic<uint32_t> remaining;
+  mutex error_mutex;
+  string error; /// message of the first failed query, if any
+
+  void complete(uint32_t query, QueryScheduler::Result &&result) {
+    if (result.error) {
+      lock_guard<mutex> lock(error_mutex);
+      if (error.empty()) {
+        error = error_message(result.error);
+      }
+    } else {
+      copy(result.ids.begin(), result.ids.end(), ids.begin() + query * top_k);
+      copy(result.distances.begin(), result.distances.end(), distances.begin() + query * top_k);
+    }
+    if (--remaining > 0) {
+      return;
+    }
+    if (!error.empty()) {
+      send_error(*connection, opcode, request_id, error);
+      return;
+    }
+    protocol::Writer response = response_header(protocol::OK, opcode, request_id);
+    response.put(num_queries);
+    response.put(top_k);
+    response.put_array(ids.data(), ids.size());
+    if (opcode == protocol::SEARCH_WITH_DISTANCE) {
+      response.put_array(distances.data(), distances.size());
+    }
+    connection->send(response);
+  }
+};
+
+static void handle_request(vector<ServedIndex> &indexes, shared_ptr<Connection> connection,
+                           const vector<uint8_t> &payload) {
+  protocol::Reader reader(payload);
+  uint8_t opcode = 0;
+  uint32_t request_id = 0, index_id = 0;
+  if (!reader.get(opcode) || !reader.get(request_id) || !reader.get(index_id)) {
+    send_error(*connection, opcode, request_id, "Malformed request header");
+    return;
+  }
+  if (index_id >= indexes.size()) {
+    send_error(*connection, opcode, request_id, "Unknown index " + to_string(index_id));
+    return;
+  }
+  BaseDenseFlinng32 &index = *indexes[index_id].index;
+  QueryScheduler &scheduler = *indexes[index_id].scheduler;
+  uint64_t dimension = index.dimension();
+
+  if (opcode == protocol::INFO) {
+    // Runs between batches so that it does not race with adds
+    scheduler.run_exclusive([&index, connection, opcode, request_id, dimension]() {
+      protocol::Writer response = response_header(protocol::OK, opcode, request_id);
+      uint64_t num_points = index.num_points_added();
+      uint8_t stores = index.stores_dataset();
+      response.put(dimension);
+      response.put(num_points);
+      response.put(stores);
+      connection->send(response);
+    });
+
+  } else if (opcode == protocol::ADD) {
+    uint32_t num_points = 0;
+    if (!reader.get(num_points) || reader.remaining() != num_points * dimension * sizeof(float)) {
+      send_error(*connection, opcode, request_id, "Malformed ADD request");
+      return;
+    }
+    shared_ptr<vector<float>> points(new vector<float>(num_points * dimension));
+    reader.get_array(points->data(), points->size());
+    scheduler.run_exclusive([&index, connection, opcode, request_id, points, num_points]() {
+      // Indexes that store their dataset keep doing so
+      bool first_add = index.num_points_added() == 0;
+      try {
+        if (index.stores_dataset()) {
+          index.add_and_store(points->data(), num_points);
+        } else {
+          index.add(points->data(), num_points);
+        }
+        index.finalize_construction();
+      } catch (const exception &e) {
+        send_error(*connection, opcode, request_id, string("ADD failed: ") + e.what());
+        return;
+      }
+      L2DenseFlinng32 *l2_index = dynamic_cast<L2DenseFlinng32 *>(&index);
+      if (first_add && l2_index != nullptr && l2_index->calibration_skipped()) {
+        cerr << "First ADD of " << num_points << " points is too small to calibrate the L2 bins, "
+             << "keeping the fixed bins" << endl;
+      }
+      protocol::Writer response = response_header(protocol::OK, opcode, request_id);
+      uint64_t total = index.num_points_added();
+      response.put(total);
+      connection->send(response);
+    });
+
+  } else if (opcode == protocol::SEARCH || opcode == protocol::SEARCH_WITH_DISTANCE) {
+    uint32_t num_queries = 0, top_k = 0;
+    if (!reader.get(num_queries) || !reader.get(top_k) || num_queries == 0 || top_k == 0 ||
+        reader.remaining() != num_queries * dimension * sizeof(float)) {
+      send_error(*connection, opcode, request_id, "Malformed SEARCH request");
+      return;
+    }
+    if (opcode == protocol::SEARCH_WITH_DISTANCE && !index.stores_dataset()) {
+      send_error(*connection, opcode, request_id, "Dataset is not stored, distances cannot be computed");
+      return;
+    }
+    vector<float> queries(num_queries * dimension);
+    reader.get_array(queries.data(), queries.size());
+
+    shared_ptr<PendingSearch> search(new PendingSearch());
+    search->connection = connection;
+    search->opcode = opcode;
+    search->request_id = request_id;
+    search->num_queries = num_queries;
+    search->top_k = top_k;
+    search->ids.resize(num_queries * top_k);
+    search->distances.resize(num_queries * top_k);
+    search->remaining = num_queries;
+    for (uint32_t query = 0; query < num_queries; query++) {
+      scheduler.submit(queries.data() + query * dimension, top_k, opcode == protocol::SEARCH_WITH_DISTANCE,
+                       [search, query](QueryScheduler::Result &&result) {
+                         search->complete(query, move(result));
+                       });
+    }
+
+  } else {
+    send_error(*connection, opcode, request_id, "Unknown opcode " + to_string(opcode));
+  }
+}
+
+// A connection thread and the connection it serves. Responses still queued
+// in a scheduler hold their own reference, so the socket is closed once the
+// session is reaped and the last of them is sent.
+struct Session {
+  thread worker;
+  shared_ptr<Connection> connection;
+  shared_ptr<atomic<bool>> finished;
+};
+
+static void serve_connection(vector<ServedIndex> &indexes, shared_ptr<Connection> connection,
+                             shared_ptr<atomic<bool>> finished) {
+  vector<uint8_t> payload;
+  while (running && protocol::recv_frame(connection->fd, payload)) {
+    handle_request(indexes, connection, payload);
+  }
+  connection.reset();
+  *finished = true;
+}
+
+// Joins the threads of closed connections and drops their references
+static void reap_sessions(vector<Session> &sessions) {
+  for (uint64_t i = 0; i < sessions.size();) {
+    if (*sessions[i].finished) {
+      sessions[i].worker.join();
+      swap(sessions[i], sessions.back());
+      sessions.pop_back();
+    } else {
+      i++;
+    }
+  }
+}
+
+static void usage() {
+  cerr << "Usage: flinng_server <socket_path> <index_file> [<index_file> ...]\n"
+       << "                     [--batch <max_batch_size>] [--delay-us <max_delay>] [--threads <n>]\n"
+       << "Indexes are numbered in the order they are given, starting at 0." << endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+
+  string socket_path = argv[1];
+  vector<string> index_files;
+  uint64_t max_batch_size = 64, max_delay_us = 500;
+  unsigned num_threads = 0;
+  for (int i = 2; i < argc; i++) {
+    string arg = argv[i];
+    if ((arg == "--batch" || arg == "--delay-us" || arg == "--threads") && i + 1 < argc) {
+      uint64_t value = stoull(argv[++i]);
+      if (arg == "--batch") {
+        max_batch_size = value;
+      } else if (arg == "--delay-us") {
+        max_delay_us = value;
+      } else {
+        num_threads = value;
+      }
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage();
+      return 1;
+    } else {
+      index_files.push_back(arg);
+    }
+  }
+
+  vector<ServedIndex> indexes(index_files.size());
+  for (uint64_t i = 0; i < index_files.size(); i++) {
+    indexes[i].index.reset(BaseDenseFlinng32::from_index(index_files[i].c_str()));
+    if (!indexes[i].index) {
+      return 1;
+    }
+    if (num_threads > 0) {
+      indexes[i].index->set_num_threads(num_threads);
+    }
+    indexes[i].scheduler.reset(new QueryScheduler(*indexes[i].index, max_batch_size,
+                                                  chrono::microseconds(max_delay_us)));
+    cout << "Index " << i << ": " << index_files[i] << ", " << indexes[i].index->num_points_added()
+         << " points of dimension " << indexes[i].index->dimension() << endl;
+  }
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    cerr << "Socket path is too long" << endl;
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path.c_str());
+  unlink(socket_path.c_str());
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      listen(listen_fd, 128) != 0) {
+    cerr << "Error while listening on " << socket_path << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  cout << "Listening on " << socket_path << endl;
+
+  vector<Session> sessions;
+  while (running) {
+    reap_sessions(sessions);
+    // Polls with a timeout so that a signal stops the server promptly
+    pollfd listen_poll = {listen_fd, POLLIN, 0};
+    if (poll(&listen_poll, 1, 200) <= 0) {
+      continue;
+    }
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    Session session;
+    session.connection.reset(new Connection(fd));
+    session.finished.reset(new atomic<bool>(false));
+    session.worker = thread(serve_connection, ref(indexes), session.connection, session.finished);
+    sessions.push_back(move(session));
+  }
+
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  // Unblocks connection threads waiting for requests, then drains the
+  // schedulers before the indexes go away
+  for (Session &session: sessions) {
+    shutdown(session.connection->fd, SHUT_RDWR);
+  }
+  for (Session &session: sessions) {
+    session.worker.join();
+  }
+  for (ServedIndex &served: indexes) {
+    served.scheduler.reset();
+  }
+  return 0;
+}
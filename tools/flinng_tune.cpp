@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Tuner.h"
+#include "lib_flinng.h"
+
+using namespace std;
+using namespace flinng;
+
+// Recommends FlinngBuilder parameters for a dataset from a sample of it.
+// Candidates are built on a uniform sample of the base file, queried with
+// held-out queries and extrapolated to the full dataset, see tune_parameters.
+
+static vector<uint64_t> parse_list(const string &arg) {
+  vector<uint64_t> values;
+  stringstream ss(arg);
+  string value;
+  while (getline(ss, value, ',')) {
+    values.push_back(stoull(value));
+  }
+  return values;
+}
+
+static void usage() {
+  cerr << "Usage: flinng_tune --base <file> [--query <file>] [--format fvecs|bvecs|float32]\n"
+       << "                   [--dim <d, for float32>] [--metric angular|l2] [--calibrate-bins 0|1] [--k <k>]\n"
+       << "                   [--target-recall <r>] [--memory-budget-mb <mb>] [--full-size <n>]\n"
+       << "                   [--sample-size <n>] [--max-queries <n>]\n"
+       << "                   [--num-rows <list>] [--points-per-cell <list>] [--tables <list>]\n"
+       << "                   [--hashes-per-table <list>] [--sub-hash-bits <list>]\n"
+       << "Lists are comma separated, every combination is tried. Without --query the last\n"
+       << "--max-queries sampled points are held out as queries. --full-size defaults to the\n"
+       << "number of points in the base file. Recall is measured against the sample's own\n"
+       << "neighbors and memory excludes the stored dataset." << endl;
+}
+
+int main(int argc, char **argv) {
+  string base_file, query_file, format = "fvecs", metric = "angular";
+  uint64_t dim = 0, sample_size = 20000, max_queries = 200;
+  double memory_budget_mb = 0;
+  TuningGoal goal;
+  TuningSpace space;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    string value = argv[++i];
+    if (arg == "--base") {
+      base_file = value;
+    } else if (arg == "--query") {
+      query_file = value;
+    } else if (arg == "--format") {
+      format = value;
+    } else if (arg == "--metric") {
+      metric = value;
+    } else if (arg == "--dim") {
+      dim = stoull(value);
+    } else if (arg == "--calibrate-bins") {
+      goal.calibrate_bins = value == "1";
+    } else if (arg == "--k") {
+      goal.k = stoul(value);
+    } else if (arg == "--target-recall") {
+      goal.target_recall = stod(value);
+    } else if (arg == "--memory-budget-mb") {
+      memory_budget_mb = stod(value);
+    } else if (arg == "--full-size") {
+      goal.full_size = stoull(value);
+    } else if (arg == "--sample-size") {
+      sample_size = stoull(value);
+    } else if (arg == "--max-queries") {
+      max_queries = stoull(value);
+    } else if (arg == "--num-rows") {
+      space.num_rows = parse_list(value);
+    } else if (arg == "--points-per-cell") {
+      space.points_per_cell = parse_list(value);
+    } else if (arg == "--tables") {
+      space.num_hash_tables = parse_list(value);
+    } else if (arg == "--hashes-per-table") {
+      space.hashes_per_table = parse_list(value);
+    } else if (arg == "--sub-hash-bits") {
+      space.sub_hash_bits = parse_list(value);
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (base_file.empty() || (metric != "angular" && metric != "l2") || format == "sparse" || max_queries == 0) {
+    usage();
+    return 1;
+  }
+  goal.l2 = metric == "l2";
+  goal.memory_budget = static_cast<uint64_t>(memory_budget_mb * (1 << 20));
+
+  // Reservoir sample of the base file, queries held out of it if not given
+  VectorFormat vector_format = format == "bvecs" ? VectorFormat::bvecs
+                                                 : format == "float32" ? VectorFormat::float32 : VectorFormat::fvecs;
+  VectorFileReader base_reader(base_file.c_str(), vector_format, dim);
+  if (!base_reader.good()) {
+    cerr << "Error while reading " << base_file << endl;
+    return 1;
+  }
+  dim = base_reader.dimension();
+  uint64_t reservoir_size = sample_size + (query_file.empty() ? max_queries : 0);
+  vector<float> sample, chunk;
+  uint64_t total_points = 0;
+  while (uint64_t num_read = base_reader.read(chunk, 1 << 16)) {
+    for (uint64_t i = 0; i < num_read; i++, total_points++) {
+      const float *point = chunk.data() + i * dim;
+      if (total_points < reservoir_size) {
+        sample.insert(sample.end(), point, point + dim);
+      } else {
+        uint64_t slot = ((static_cast<uint64_t>(rand()) << 31) ^ rand()) % (total_points + 1);
+        if (slot < reservoir_size) {
+          copy(point, point + dim, sample.begin() + slot * dim);
+        }
+      }
+    }
+  }
+
+  vector<float> queries;
+  if (query_file.empty()) {
+    uint64_t num_held_out = min<uint64_t>(max_queries, sample.size() / dim / 2);
+    queries.assign(sample.end() - num_held_out * dim, sample.end());
+    sample.resize(sample.size() - num_held_out * dim);
+  } else {
+    VectorFileReader query_reader(query_file.c_str(), vector_format, dim);
+    if (!query_reader.good() || query_reader.dimension() != dim) {
+      cerr << "Error while reading " << query_file << endl;
+      return 1;
+    }
+    while (queries.size() / dim < max_queries) {
+      uint64_t num_read = query_reader.read(chunk, max_queries - queries.size() / dim);
+      if (num_read == 0) {
+        break;
+      }
+      queries.insert(queries.end(), chunk.begin(), chunk.begin() + num_read * dim);
+    }
+  }
+  uint64_t num_points = sample.size() / dim, num_queries = queries.size() / dim;
+  if (num_points == 0 || num_queries == 0) {
+    cerr << "No sample points or queries to tune with" << endl;
+    return 1;
+  }
+  if (goal.full_size == 0) {
+    goal.full_size = total_points;
+  }
+  cout << "Tuning on " << num_points << " of " << goal.full_size << " points with " << num_queries
+       << " queries" << endl;
+
+  TuningResult result = tune_parameters(sample.data(), num_points, queries.data(), num_queries, dim, goal, space);
+  result.print(cout);
+  return result.meets_goal ? 0 : 2;
+}